@@ -0,0 +1,78 @@
+#!/bin/sh
+# Run the benchmark matrix headless and collect the results as CSV and JSON.
+#
+# The particle counts, box sizes and group sizes are the ones plotted by
+# plots.m. Environment variables override the defaults:
+#   BENCH_ENGINE   cl or cpu                      (cl)
+#   BENCH_KERNELS  force kernels to run           (all of them)
+#   BENCH_GROUPS   group sizes to run             (16 ... 1024, cpu: 32)
+#   BENCH_STEPS    timed steps per configuration  (200)
+#   BENCH_WARMUP   untimed steps first            (20)
+#   BENCH_SEED     random seed                    (1)
+#   BENCH_BATCH    steps per runKernel, 0=adapt   (1)
+#   BENCH_OUT      output prefix                  (bench)
+
+MD=${MD:-./md}
+ENGINE=${BENCH_ENGINE:-cl}
+KERNELS=${BENCH_KERNELS:-"force_naive force_naive_clip force_tile force_tile_clip force_block
+force_block_clip force_split force_split_clip force_cell force_nlist force_naive_fast
+force_naive_clip_fast force_tile_fast force_tile_clip_fast force_block_fast
+force_block_clip_fast force_split_fast force_split_clip_fast force_cell_fast
+force_nlist_fast"}
+# The CPU engine ignores the group size.
+if [ "$ENGINE" = cpu ]; then
+  GROUP_SIZES=${BENCH_GROUPS:-32}
+else
+  GROUP_SIZES=${BENCH_GROUPS:-"16 32 64 128 256 512 1024"}
+fi
+STEPS=${BENCH_STEPS:-200}
+WARMUP=${BENCH_WARMUP:-20}
+SEED=${BENCH_SEED:-1}
+BATCH=${BENCH_BATCH:-1}
+OUT=${BENCH_OUT:-bench}
+
+# nparticles:bbox pairs.
+SIZES="1024:100 2048:100 4096:100 6144:100 8192:100 12288:100 16384:100
+16384:200"
+
+rm -f "$OUT.csv" "$OUT.json"
+failed=0
+
+for size in $SIZES; do
+  n=${size%%:*}
+  b=${size##*:}
+  for k in $KERNELS; do
+    for g in $GROUP_SIZES; do
+      echo "== $ENGINE $k n=$n bbox=$b group=$g"
+      if ! "$MD" --headless --engine "$ENGINE" --nparticles "$n" --bbox "$b" \
+           --group-size "$g" --force-kernel "$k" --steps "$STEPS" \
+           --warmup "$WARMUP" --seed "$SEED" --steps-per-frame "$BATCH" \
+           --report "$OUT.csv" \
+           > /dev/null; then
+        echo "   failed, skipping"
+        failed=$((failed + 1))
+      fi
+    done
+  done
+done
+
+if [ ! -f "$OUT.csv" ]; then
+  echo "No configuration ran successfully."
+  exit 1
+fi
+
+# Convert the CSV to a JSON array of objects. Text columns are quoted.
+awk -F, '
+NR == 1 { for (i = 1; i <= NF; i++) key[i] = $i; n = NF; print "["; next }
+{
+  printf "%s  {", (NR > 2 ? ",\n" : "")
+  for (i = 1; i <= n; i++) {
+    v = (i <= 2) ? "\"" $i "\"" : $i
+    printf "%s\"%s\": %s", (i > 1 ? ", " : ""), key[i], v
+  }
+  printf "}"
+}
+END { if (NR > 0) print "\n]" }
+' "$OUT.csv" > "$OUT.json"
+
+echo "Wrote $OUT.csv and $OUT.json ($failed configurations failed)."
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#include "checkpoint.hpp"
+
+
+// File layout: the header, the settings text, then num positions,
+// velocities and forces and the thermostat state, all cl_float4, in native
+// byte order.
+#define CHECKPOINT_MAGIC "MDCKPT1"
+#define CHECKPOINT_VERSION 1
+
+namespace {
+
+struct checkpoint_header {
+  char magic[8];           // CHECKPOINT_MAGIC, NUL terminated.
+  uint32_t version;        // CHECKPOINT_VERSION.
+  uint32_t num;            // Particles.
+  int32_t step;            // Steps run.
+  uint32_t settings_size;  // Bytes of settings text that follow.
+};
+
+
+bool readFloat4(FILE *f, std::vector<cl_float4> *v, size_t num) {
+  v->resize(num);
+  if (num == 0)
+    return true;
+  return fread(&(*v)[0], sizeof(cl_float4), num, f) == num;
+}
+
+
+bool writeFloat4(FILE *f, const std::vector<cl_float4> &v) {
+  return v.empty() || fwrite(&v[0], sizeof(cl_float4), v.size(), f) ==
+    v.size();
+}
+
+}
+
+
+bool checkpointLoad(const std::string &path, checkpoint *ck) {
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f) {
+    perror(path.c_str());
+    return false;
+  }
+  checkpoint_header h;
+  bool ok = fread(&h, sizeof(h), 1, f) == 1;
+  if (!ok || strncmp(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic)) != 0 ||
+      h.version != CHECKPOINT_VERSION) {
+    printf("ERROR: %s is not a version %d checkpoint\n", path.c_str(),
+           CHECKPOINT_VERSION);
+    fclose(f);
+    return false;
+  }
+  ck->settings.resize(h.settings_size);
+  ck->state.step = h.step;
+  ok = (h.settings_size == 0 ||
+        fread(&ck->settings[0], 1, h.settings_size, f) == h.settings_size) &&
+    readFloat4(f, &ck->state.pos, h.num) &&
+    readFloat4(f, &ck->state.vel, h.num) &&
+    readFloat4(f, &ck->state.force, h.num) &&
+    fread(&ck->state.thermo, sizeof(cl_float4), 1, f) == 1;
+  fclose(f);
+  if (!ok)
+    printf("ERROR: %s is truncated\n", path.c_str());
+  return ok;
+}
+
+
+bool checkpointStore(const std::string &path, const checkpoint &ck) {
+  std::string tmp = path + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (!f) {
+    perror(tmp.c_str());
+    return false;
+  }
+  const engine_state &s = ck.state;
+  checkpoint_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic));
+  h.version = CHECKPOINT_VERSION;
+  h.num = s.pos.size();
+  h.step = s.step;
+  h.settings_size = ck.settings.size();
+  bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+    fwrite(ck.settings.data(), 1, ck.settings.size(), f) ==
+      ck.settings.size() &&
+    writeFloat4(f, s.pos) && writeFloat4(f, s.vel) && writeFloat4(f, s.force) &&
+    fwrite(&s.thermo, sizeof(cl_float4), 1, f) == 1;
+  // On disk before the rename, so a crash leaves the old or the new file.
+  ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+    perror(path.c_str());
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+
+CheckpointWriter::CheckpointWriter(const std::string &path_val) {
+  path = path_val;
+  pending = false;
+  closing = false;
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&cond, NULL);
+  pthread_create(&thread, NULL, run, this);
+}
+
+
+CheckpointWriter::~CheckpointWriter() {
+  pthread_mutex_lock(&mutex);
+  closing = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+  pthread_join(thread, NULL);
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&mutex);
+}
+
+
+checkpoint &CheckpointWriter::begin() {
+  pthread_mutex_lock(&mutex);
+  while (pending)
+    pthread_cond_wait(&cond, &mutex);
+  pthread_mutex_unlock(&mutex);
+  return slot;
+}
+
+
+void CheckpointWriter::commit() {
+  pthread_mutex_lock(&mutex);
+  pending = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+}
+
+
+void *CheckpointWriter::run(void *arg) {
+  CheckpointWriter *w = (CheckpointWriter *)arg;
+  pthread_mutex_lock(&w->mutex);
+  for (;;) {
+    while (!w->pending && !w->closing)
+      pthread_cond_wait(&w->cond, &w->mutex);
+    if (!w->pending)
+      break;
+    // The slot is ours until pending is cleared.
+    pthread_mutex_unlock(&w->mutex);
+    if (checkpointStore(w->path, w->slot))
+      printf("Checkpoint at step %d written to %s\n", w->slot.state.step,
+             w->path.c_str());
+    pthread_mutex_lock(&w->mutex);
+    w->pending = false;
+    pthread_cond_broadcast(&w->cond);
+  }
+  pthread_mutex_unlock(&w->mutex);
+  return NULL;
+}
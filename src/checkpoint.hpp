@@ -0,0 +1,50 @@
+#ifndef MD_CHECKPOINT_H_INCLUDED
+#define MD_CHECKPOINT_H_INCLUDED
+
+#include <string>
+#include <pthread.h>
+
+#include "engine.hpp"
+
+
+// Everything needed to continue a run: the run's settings, as "key=value"
+// lines, and the engine state.
+struct checkpoint {
+  std::string settings;
+  engine_state state;
+};
+
+
+// Read a checkpoint. Prints the reason and returns false on failure.
+bool checkpointLoad(const std::string &path, checkpoint *ck);
+
+// Write a checkpoint under a temporary name, sync it and rename it over
+// path, so path always holds a complete checkpoint, old or new.
+bool checkpointStore(const std::string &path, const checkpoint &ck);
+
+
+// Writes checkpoints on a background thread. The simulation fills the slot
+// from begin() and hands it over with commit(). There is one slot, so
+// begin() waits if the previous checkpoint is still being written.
+class CheckpointWriter {
+public:
+  CheckpointWriter(const std::string &path_val);
+  // Finish the pending checkpoint, if any.
+  ~CheckpointWriter();
+
+  checkpoint &begin();
+  void commit();
+
+private:
+  static void *run(void *arg);
+
+  std::string path;
+  checkpoint slot;
+  bool pending;  // slot holds a checkpoint not yet written.
+  bool closing;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t thread;
+};
+
+#endif
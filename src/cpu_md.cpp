@@ -0,0 +1,694 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <algorithm>
+#include <float.h>
+
+// OpenGL stuff.
+#define GL_GLEXT_PROTOTYPES
+#include <GL/glut.h>
+#include <GL/glext.h>
+
+
+#include "cpu_md.hpp"
+#include "cycle_timer.hpp"
+#include "energy.hpp"
+#include "rng.hpp"
+#include "trajectory.hpp"
+#include "util.hpp"
+
+
+namespace {
+
+// Runs one phase of a CPUMD step on a pool thread.
+class Phase : public ThreadPool::Task {
+public:
+  typedef void (CPUMD::*fn_t)(int, int);
+  Phase(CPUMD *md_val, fn_t fn_val) : md(md_val), fn(fn_val) {}
+  void run(int tid, int nthreads) { (md->*fn)(tid, nthreads); }
+private:
+  CPUMD *md;
+  fn_t fn;
+};
+
+}
+
+
+CPUMD::CPUMD(bool headless_val, int nthreads) : pool(nthreads) {
+  headless = headless_val;
+  num = 0;
+  pos_vbo = col_vbo = 0;
+  cutoff = 10.f;
+  skin = 2.f;
+  need_rebuild = true;
+  pbc = false;
+  verlet = false;
+  have_forces = false;
+  thermostat = THERMO_NONE;
+  thermo_every = 100;
+  step_count = 0;
+  temp = 0.f;
+  thermo_scale = 1.f;
+  nh_xi = 0.f;
+  observe_every = 0;
+  traj = NULL;
+  traj_every = 0;
+  phase_neighbor = profile.addPhase("neighbor");
+  phase_force = profile.addPhase("force");
+  phase_update = profile.addPhase("update");
+  phase_observe = profile.addPhase("observe");
+  const char *isa;
+  lj_row = lj_row_select(&isa);
+  printf("Native CPU engine with %d threads, %s pair kernel\n", pool.size(),
+         isa);
+}
+
+
+CPUMD::~CPUMD()
+{}
+
+
+void CPUMD::loadData(const std::vector<cl_float4> &pos_val,
+                     const std::vector<cl_float4> &force_val,
+                     const std::vector<cl_float4> &vel_val,
+                     const std::vector<cl_float4> &col_val) {
+  num = pos_val.size();
+  array_size = num * sizeof(cl_float4);
+  pos = pos_val;
+  col = col_val;
+
+  // Split into structure-of-arrays.
+  x.resize(num); y.resize(num); z.resize(num);
+  vx.resize(num); vy.resize(num); vz.resize(num);
+  fx.resize(num); fy.resize(num); fz.resize(num);
+  for (int i = 0; i < num; i++) {
+    x[i] = pos[i].s[0]; y[i] = pos[i].s[1]; z[i] = pos[i].s[2];
+    vx[i] = vel_val[i].s[0]; vy[i] = vel_val[i].s[1]; vz[i] = vel_val[i].s[2];
+    fx[i] = force_val[i].s[0]; fy[i] = force_val[i].s[1];
+    fz[i] = force_val[i].s[2];
+  }
+
+  thread_force.resize(pool.size());
+  for (int t = 0; t < pool.size(); t++)
+    thread_force[t].resize(3 * num);
+
+  if (!headless) {
+    // Create VBOs (defined in util.cpp). They are refreshed after each step.
+    pos_vbo = createVBO(&pos[0], array_size, GL_ARRAY_BUFFER,
+                        GL_DYNAMIC_DRAW);
+    col_vbo = createVBO(&col[0], array_size, GL_ARRAY_BUFFER,
+                        GL_DYNAMIC_DRAW);
+  }
+}
+
+
+void CPUMD::init(const sim_params &params) {
+  bound = params.bound;
+  dt = params.dt;
+  skin = params.skin;
+  cutoff = params.cutoff;
+  mass = params.mass;
+  elasticity = params.elasticity;
+  if (params.integrator == "verlet") {
+    verlet = true;
+  } else if (params.integrator != "euler") {
+    printf("ERROR: unknown integrator %s\n", params.integrator.c_str());
+    exit(EXIT_FAILURE);
+  }
+  thermostat = thermostatId(params.thermostat);
+  if (thermostat < 0) {
+    printf("ERROR: unknown thermostat %s\n", params.thermostat.c_str());
+    exit(EXIT_FAILURE);
+  }
+  target_temp = params.temperature;
+  tau = params.tau;
+  seed = params.seed;
+  thermo_every = std::max(1, params.thermo_every);
+  thread_ke.resize(pool.size());
+  observe_every = std::max(0, params.observe_every);
+  epsilon = params.epsilon;
+  thread_pe.resize(pool.size());
+  thread_vir.resize(pool.size());
+
+  // The CPU pair kernels already work from r^2, so _fast changes nothing.
+  std::string name = kernelBaseName(params.force_kernel_name);
+  if (allPairsKernel(name)) {
+    mode = ALL_PAIRS;
+  } else if (allPairsClipKernel(name)) {
+    mode = ALL_PAIRS_CLIP;
+  } else if (name == "force_cell" || name == "force_nlist") {
+    mode = NEIGHBOR_LIST;
+  } else {
+    printf("ERROR: unknown force kernel %s\n", name.c_str());
+    exit(EXIT_FAILURE);
+  }
+
+  consts.sigma2 = params.sigma * params.sigma;
+  consts.scale = 24 * params.epsilon / 1e-10f;
+  consts.cutoff2 = mode == ALL_PAIRS ? FLT_MAX : cutoff * cutoff;
+  pbc = params.pbc;
+  consts.box = pbc ? 2 * bound : 0.f;
+  consts.inv_box = pbc ? 1 / (2 * bound) : 0.f;
+
+  if (mode == NEIGHBOR_LIST) {
+    // Cells at least cutoff + skin wide, as in MD::cellInit.
+    float radius = cutoff + skin;
+    cell_n = std::max(1, (int)floor(2 * bound / radius));
+    if (pbc && cell_n < 3) {
+      // The wrapped 3x3x3 search would see some cells twice.
+      printf("ERROR: with PBC the box must be at least 3 cells (%f A) wide\n",
+             3 * radius);
+      exit(EXIT_FAILURE);
+    }
+    cell_size = 2 * bound / cell_n;
+    cell_start.resize(cell_n * cell_n * cell_n + 1);
+    cell_members.resize(num);
+    nlist.resize(pool.size());
+    nlist_start.resize(num);
+    nlist_count.resize(num);
+    x_ref.resize(num); y_ref.resize(num); z_ref.resize(num);
+    thread_moved.resize(pool.size());
+    need_rebuild = true;
+    printf("Half neighbor lists: radius %f A, %d^3 cells.\n", radius, cell_n);
+  }
+}
+
+
+float CPUMD::minImage(float d) const {
+  if (!pbc)
+    return d;
+  return d - consts.box * rintf(d * consts.inv_box);
+}
+
+
+int CPUMD::cellOf(float px, float py, float pz) const {
+  int cx = std::min(std::max((int)((px + bound) / cell_size), 0), cell_n - 1);
+  int cy = std::min(std::max((int)((py + bound) / cell_size), 0), cell_n - 1);
+  int cz = std::min(std::max((int)((pz + bound) / cell_size), 0), cell_n - 1);
+  return (cz * cell_n + cy) * cell_n + cx;
+}
+
+
+void CPUMD::binCells() {
+  // Counting sort of the particles by cell.
+  std::fill(cell_start.begin(), cell_start.end(), 0);
+  for (int i = 0; i < num; i++)
+    cell_start[cellOf(x[i], y[i], z[i]) + 1]++;
+  for (size_t c = 1; c < cell_start.size(); c++)
+    cell_start[c] += cell_start[c - 1];
+  std::vector<int> fill(cell_start.begin(), cell_start.end() - 1);
+  for (int i = 0; i < num; i++)
+    cell_members[fill[cellOf(x[i], y[i], z[i])]++] = i;
+}
+
+
+void CPUMD::buildNeighbors(int tid, int nthreads) {
+  int begin, end;
+  ThreadPool::range(num, tid, nthreads, &begin, &end);
+  float radius = cutoff + skin;
+  float radius2 = radius * radius;
+  std::vector<int> &list = nlist[tid];
+  list.clear();
+
+  for (int i = begin; i < end; i++) {
+    float px = x[i], py = y[i], pz = z[i];
+    int c = cellOf(px, py, pz);
+    int cx = c % cell_n, cy = (c / cell_n) % cell_n, cz = c / (cell_n * cell_n);
+    nlist_start[i] = list.size();
+
+    for (int dz = -1; dz <= 1; dz++) {
+      for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+          int nx = cx + dx, ny = cy + dy, nz = cz + dz;
+          if (pbc) {
+            nx = (nx + cell_n) % cell_n;
+            ny = (ny + cell_n) % cell_n;
+            nz = (nz + cell_n) % cell_n;
+          } else if (nx < 0 || ny < 0 || nz < 0 ||
+                     nx >= cell_n || ny >= cell_n || nz >= cell_n) {
+            continue;
+          }
+          int cell = (nz * cell_n + ny) * cell_n + nx;
+          for (int k = cell_start[cell]; k < cell_start[cell + 1]; k++) {
+            int j = cell_members[k];
+            float rx = minImage(px - x[j]);
+            float ry = minImage(py - y[j]);
+            float rz = minImage(pz - z[j]);
+            // Half list: each pair is stored once, by its lower index.
+            if (j > i && rx * rx + ry * ry + rz * rz < radius2)
+              list.push_back(j);
+          }
+        }
+      }
+    }
+
+    nlist_count[i] = list.size() - nlist_start[i];
+    x_ref[i] = px; y_ref[i] = py; z_ref[i] = pz;
+  }
+}
+
+
+void CPUMD::computeForces(int tid, int nthreads) {
+  std::vector<float> &f = thread_force[tid];
+  std::fill(f.begin(), f.end(), 0.f);
+  lj_soa soa;
+  soa.x = &x[0]; soa.y = &y[0]; soa.z = &z[0];
+  soa.fx = &f[0]; soa.fy = &f[num]; soa.fz = &f[2 * num];
+
+  if (mode == NEIGHBOR_LIST) {
+    int begin, end;
+    ThreadPool::range(num, tid, nthreads, &begin, &end);
+    const int *list = nlist[tid].empty() ? NULL : &nlist[tid][0];
+    for (int i = begin; i < end; i++) {
+      if (nlist_count[i] > 0)
+        lj_row(soa, i, list + nlist_start[i], 0, nlist_count[i], consts);
+    }
+  } else {
+    // Interleave rows so every thread gets a similar share of the triangle.
+    for (int i = tid; i < num - 1; i += nthreads)
+      lj_row(soa, i, NULL, i + 1, num - i - 1, consts);
+  }
+}
+
+
+void CPUMD::sumForces(int begin, int end, int nthreads) {
+  // Gather the per-thread partial forces.
+  float *f[3] = { &fx[0], &fy[0], &fz[0] };
+  for (int k = 0; k < 3; k++) {
+    for (int i = begin; i < end; i++) {
+      float fk = 0.f;
+      for (int t = 0; t < nthreads; t++)
+        fk += thread_force[t][k * num + i];
+      f[k][i] = fk;
+    }
+  }
+}
+
+
+void CPUMD::halfKick(int begin, int end) {
+  float h = 0.5f * dt / mass;
+  for (int i = begin; i < end; i++) {
+    vx[i] += fx[i] * h;
+    vy[i] += fy[i] * h;
+    vz[i] += fz[i] * h;
+  }
+}
+
+
+void CPUMD::drift(int begin, int end) {
+  float *p[3] = { &x[0], &y[0], &z[0] };
+  float *v[3] = { &vx[0], &vy[0], &vz[0] };
+  for (int k = 0; k < 3; k++) {
+    for (int i = begin; i < end; i++) {
+      // Same wall handling as the update kernel.
+      float pk = p[k][i] + v[k][i] * dt * 1e10f;
+      if (pbc) {
+        p[k][i] = pk - 2 * bound * floorf((pk + bound) / (2 * bound));
+        continue;
+      }
+      if (pk >= bound || pk <= -bound)
+        v[k][i] = -elasticity * v[k][i];
+      pk = std::min(std::max(pk, -bound), bound);
+      p[k][i] = pk;
+    }
+  }
+}
+
+
+void CPUMD::finishMove(int tid, int begin, int end) {
+  if (!headless)
+    fillVisual(begin, end, &pos[0], &col[0]);
+
+  if (mode == NEIGHBOR_LIST) {
+    float half_skin2 = skin * skin / 4;
+    bool moved = false;
+    for (int i = begin; i < end; i++) {
+      float dx = minImage(x[i] - x_ref[i]);
+      float dy = minImage(y[i] - y_ref[i]);
+      float dz = minImage(z[i] - z_ref[i]);
+      if (dx * dx + dy * dy + dz * dz > half_skin2)
+        moved = true;
+    }
+    thread_moved[tid] = moved;
+  }
+}
+
+
+void CPUMD::update(int tid, int nthreads) {
+  int begin, end;
+  ThreadPool::range(num, tid, nthreads, &begin, &end);
+  sumForces(begin, end, nthreads);
+  // Same integration as the update kernel, a full kick then a drift.
+  float h = dt / mass;
+  for (int i = begin; i < end; i++) {
+    vx[i] += fx[i] * h;
+    vy[i] += fy[i] * h;
+    vz[i] += fz[i] * h;
+  }
+  drift(begin, end);
+  finishMove(tid, begin, end);
+}
+
+
+void CPUMD::kickDrift(int tid, int nthreads) {
+  int begin, end;
+  ThreadPool::range(num, tid, nthreads, &begin, &end);
+  halfKick(begin, end);
+  drift(begin, end);
+  finishMove(tid, begin, end);
+}
+
+
+void CPUMD::kick(int tid, int nthreads) {
+  int begin, end;
+  ThreadPool::range(num, tid, nthreads, &begin, &end);
+  sumForces(begin, end, nthreads);
+  halfKick(begin, end);
+}
+
+
+void CPUMD::gatherForces(int tid, int nthreads) {
+  int begin, end;
+  ThreadPool::range(num, tid, nthreads, &begin, &end);
+  sumForces(begin, end, nthreads);
+}
+
+
+void CPUMD::kineticSum(int tid, int nthreads) {
+  int begin, end;
+  ThreadPool::range(num, tid, nthreads, &begin, &end);
+  double sum = 0;
+  for (int i = begin; i < end; i++)
+    sum += vx[i] * vx[i] + vy[i] * vy[i] + vz[i] * vz[i];
+  thread_ke[tid] = sum;
+}
+
+
+void CPUMD::applyThermostat(int tid, int nthreads) {
+  int begin, end;
+  ThreadPool::range(num, tid, nthreads, &begin, &end);
+  if (thermostat != THERMO_LANGEVIN) {
+    for (int i = begin; i < end; i++) {
+      vx[i] *= thermo_scale;
+      vy[i] *= thermo_scale;
+      vz[i] *= thermo_scale;
+    }
+    return;
+  }
+  // Langevin: exact friction plus matching noise over one time step.
+  float c1 = expf(-dt / tau);
+  float c2 = sqrtf((1 - c1 * c1) * KB * target_temp / mass);
+  for (int i = begin; i < end; i++) {
+    unsigned int h = pcg_hash(seed ^ pcg_hash(step_count ^ pcg_hash(i)));
+    float u[4];
+    for (int k = 0; k < 4; k++) {
+      h = pcg_hash(h);
+      u[k] = pcg_uniform(h);
+    }
+    // Box-Muller, three of the four normals.
+    float r1 = sqrtf(-2 * logf(u[0])), r2 = sqrtf(-2 * logf(u[2]));
+    vx[i] = c1 * vx[i] + c2 * r1 * cosf(2 * (float)M_PI * u[1]);
+    vy[i] = c1 * vy[i] + c2 * r1 * sinf(2 * (float)M_PI * u[1]);
+    vz[i] = c1 * vz[i] + c2 * r2 * cosf(2 * (float)M_PI * u[3]);
+  }
+}
+
+
+void CPUMD::runThermostat() {
+  step_count++;
+  bool report = step_count % thermo_every == 0;
+  bool scale = thermostat == THERMO_BERENDSEN ||
+    thermostat == THERMO_NOSE_HOOVER;
+  if (report || scale) {
+    Phase sum(this, &CPUMD::kineticSum);
+    pool.run(&sum);
+    double v2 = 0;
+    for (size_t t = 0; t < thread_ke.size(); t++)
+      v2 += thread_ke[t];
+    // Equipartition over 3 degrees of freedom per particle.
+    float t = mass * v2 / (3 * num * KB);
+    if (report)
+      temp = t;
+    if (thermostat == THERMO_BERENDSEN) {
+      float ratio = t > 0 ? target_temp / t : 1.f;
+      thermo_scale = std::min(std::max(sqrtf(1 + dt / tau * (ratio - 1)),
+                                       0.8f), 1.25f);
+    } else if (thermostat == THERMO_NOSE_HOOVER) {
+      nh_xi += dt / (tau * tau) * (t / target_temp - 1);
+      thermo_scale = expf(-nh_xi * dt);
+    }
+  }
+  if (thermostat != THERMO_NONE) {
+    Phase apply(this, &CPUMD::applyThermostat);
+    pool.run(&apply);
+  }
+}
+
+
+float CPUMD::temperature() {
+  return temp;
+}
+
+
+void CPUMD::observePairs(int tid, int nthreads) {
+  // Same pairs, clamps and cutoff shift as the force kernels, in double.
+  double sigma2 = consts.sigma2;
+  double shift = 0;
+  if (mode != ALL_PAIRS) {
+    double s6 = sigma2 / (cutoff * cutoff);
+    s6 = s6 * s6 * s6;
+    shift = 4 * epsilon * (s6 * s6 - s6);
+  }
+  double pe = 0, vir = 0;
+  int begin = tid, end = num - 1, stride = nthreads;
+  if (mode == NEIGHBOR_LIST) {
+    ThreadPool::range(num, tid, nthreads, &begin, &end);
+    stride = 1;
+  }
+  const int *list = NULL;
+  if (mode == NEIGHBOR_LIST && !nlist[tid].empty())
+    list = &nlist[tid][0];
+  for (int i = begin; i < end; i += stride) {
+    int count = mode == NEIGHBOR_LIST ? nlist_count[i] : num - i - 1;
+    const int *js = mode == NEIGHBOR_LIST ? list + nlist_start[i] : NULL;
+    for (int k = 0; k < count; k++) {
+      int j = js ? js[k] : i + 1 + k;
+      float dx = minImage(x[i] - x[j]);
+      float dy = minImage(y[i] - y[j]);
+      float dz = minImage(z[i] - z[j]);
+      double r2 = dx * dx + dy * dy + dz * dz;
+      if (r2 >= consts.cutoff2 || r2 <= 1e-10)
+        continue;
+      double inv2 = 1 / std::max(r2, 0.01);
+      double s6 = sigma2 * inv2;
+      s6 = s6 * s6 * s6;
+      pe += 4 * epsilon * (s6 * s6 - s6) - shift;
+      // d.F for the force of lj_force_r2, which is a multiple of d.
+      vir += consts.scale * (2 * s6 * s6 - s6) * inv2 * r2;
+    }
+  }
+  thread_pe[tid] = pe;
+  thread_vir[tid] = vir;
+}
+
+
+void CPUMD::runObserve() {
+  Phase sum(this, &CPUMD::kineticSum);
+  pool.run(&sum);
+  Phase pairs(this, &CPUMD::observePairs);
+  pool.run(&pairs);
+  double v2 = 0, pe = 0, vir = 0;
+  for (int t = 0; t < pool.size(); t++) {
+    v2 += thread_ke[t];
+    pe += thread_pe[t];
+    vir += thread_vir[t];
+  }
+  // The virial comes in Newton * Angstrom.
+  obs_samples.push_back(makeObservables(step_count, 0.5 * mass * v2, pe,
+                                        vir * 1e-10, num, bound));
+}
+
+
+void CPUMD::takeObservables(std::vector<observables> *out) {
+  out->insert(out->end(), obs_samples.begin(), obs_samples.end());
+  obs_samples.clear();
+}
+
+
+void CPUMD::setTrajectory(TrajectoryWriter *writer, int every) {
+  traj = writer;
+  traj_every = std::max(1, every);
+}
+
+
+void CPUMD::saveState(engine_state *out) {
+  out->step = step_count;
+  out->pos.resize(num);
+  out->vel.resize(num);
+  out->force.resize(num);
+  for (int i = 0; i < num; i++) {
+    out->pos[i] = f4(x[i], y[i], z[i], 1.f);
+    out->vel[i] = f4(vx[i], vy[i], vz[i], 0.f);
+    out->force[i] = f4(fx[i], fy[i], fz[i], 0.f);
+  }
+  out->thermo = f4(temp, thermo_scale, nh_xi, 0.f);
+  // Rebuild from these positions, as the restarted run will.
+  need_rebuild = true;
+}
+
+
+void CPUMD::restoreState(const engine_state &in) {
+  if ((int)in.pos.size() != num) {
+    printf("ERROR: the saved state has %d particles, not %d\n",
+           (int)in.pos.size(), num);
+    exit(EXIT_FAILURE);
+  }
+  step_count = in.step;
+  for (int i = 0; i < num; i++) {
+    x[i] = in.pos[i].s[0]; y[i] = in.pos[i].s[1]; z[i] = in.pos[i].s[2];
+    vx[i] = in.vel[i].s[0]; vy[i] = in.vel[i].s[1]; vz[i] = in.vel[i].s[2];
+    fx[i] = in.force[i].s[0]; fy[i] = in.force[i].s[1];
+    fz[i] = in.force[i].s[2];
+  }
+  temp = in.thermo.s[0];
+  thermo_scale = in.thermo.s[1];
+  nh_xi = in.thermo.s[2];
+  // The saved forces are those at the saved positions.
+  have_forces = true;
+  need_rebuild = true;
+  if (!headless)
+    fillVisual(0, num, &pos[0], &col[0]);
+}
+
+
+void CPUMD::writeTrajectory() {
+  // Copy straight into the writer's slot, the file is written on its thread.
+  TrajectoryWriter::frame &f = traj->begin();
+  f.step = step_count;
+  if (traj->compressed()) {
+    float inv_precision = 1.f / traj->precision();
+    int bits = traj->bits(), words = traj->words();
+    for (int i = 0; i < num; i++)
+      trajPack(x[i], y[i], z[i], bound, inv_precision, bits,
+               &f.packed[words * i]);
+  } else {
+    for (int i = 0; i < num; i++) {
+      f.pos[3 * i] = x[i];
+      f.pos[3 * i + 1] = y[i];
+      f.pos[3 * i + 2] = z[i];
+    }
+  }
+  if (traj->velocities()) {
+    for (int i = 0; i < num; i++) {
+      f.vel[3 * i] = vx[i];
+      f.vel[3 * i + 1] = vy[i];
+      f.vel[3 * i + 2] = vz[i];
+    }
+  }
+  traj->commit();
+}
+
+
+void CPUMD::fillVisual(int begin, int end, cl_float4 *pos_out,
+                       cl_float4 *col_out) const {
+  for (int i = begin; i < end; i++) {
+    pos_out[i] = f4(x[i], y[i], z[i], 1.f);
+    col_out[i] = f4(std::min(std::max((x[i] + bound) / (2 * bound), 0.2f), 1.f),
+                    std::min(std::max((y[i] + bound) / (2 * bound), 0.2f), 1.f),
+                    std::min(std::max((z[i] + bound) / (2 * bound), 0.2f), 1.f),
+                    1.f);
+  }
+}
+
+
+void CPUMD::readState(cl_float4 *pos_out, cl_float4 *col_out) {
+  fillVisual(0, num, pos_out, col_out);
+}
+
+
+void CPUMD::readVelocities(cl_float4 *vel_out) {
+  for (int i = 0; i < num; i++)
+    vel_out[i] = f4(vx[i], vy[i], vz[i], 0.f);
+}
+
+
+void CPUMD::runNeighbors() {
+  binCells();
+  Phase build(this, &CPUMD::buildNeighbors);
+  pool.run(&build);
+}
+
+
+void CPUMD::runKernel(int nsteps) {
+  if (verlet && !have_forces) {
+    // Forces at the starting positions for the first kick.
+    if (mode == NEIGHBOR_LIST)
+      runNeighbors();
+    Phase forces(this, &CPUMD::computeForces);
+    pool.run(&forces);
+    Phase gather(this, &CPUMD::gatherForces);
+    pool.run(&gather);
+    need_rebuild = false;
+    have_forces = true;
+  }
+
+  for (int step = 0; step < nsteps; step++) {
+    double t0 = CycleTimer::currentSeconds();
+    double t_move = 0;
+    if (verlet) {
+      Phase move(this, &CPUMD::kickDrift);
+      pool.run(&move);
+      if (mode == NEIGHBOR_LIST && std::find(thread_moved.begin(),
+                                             thread_moved.end(), 1) !=
+          thread_moved.end())
+        need_rebuild = true;
+      double t = CycleTimer::currentSeconds();
+      t_move = t - t0;
+      t0 = t;
+    }
+    double t_neighbor = 0;
+    if (mode == NEIGHBOR_LIST && need_rebuild) {
+      runNeighbors();
+      need_rebuild = false;
+      double t = CycleTimer::currentSeconds();
+      t_neighbor = t - t0;
+      t0 = t;
+    }
+
+    Phase forces(this, &CPUMD::computeForces);
+    pool.run(&forces);
+    double t1 = CycleTimer::currentSeconds();
+    Phase integrate(this, verlet ? &CPUMD::kick : &CPUMD::update);
+    pool.run(&integrate);
+    runThermostat();
+    double t2 = CycleTimer::currentSeconds();
+    // Every step, rebuild or not, so the phases add up to the step time as
+    // on the device.
+    if (mode == NEIGHBOR_LIST)
+      profile.record(phase_neighbor, 1000 * t_neighbor);
+    profile.record(phase_force, 1000 * (t1 - t0));
+    profile.record(phase_update, 1000 * (t_move + t2 - t1));
+    if (observe_every > 0 && step_count % observe_every == 0) {
+      runObserve();
+      profile.record(phase_observe,
+                     1000 * (CycleTimer::currentSeconds() - t2));
+    }
+    if (traj && step_count % traj_every == 0)
+      writeTrajectory();
+
+    if (mode == NEIGHBOR_LIST && !verlet &&
+        std::find(thread_moved.begin(), thread_moved.end(), 1) !=
+        thread_moved.end())
+      need_rebuild = true;
+  }
+
+  if (!headless) {
+    // Refresh the VBOs for the renderer.
+    glBindBuffer(GL_ARRAY_BUFFER, pos_vbo);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, array_size, &pos[0]);
+    glBindBuffer(GL_ARRAY_BUFFER, col_vbo);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, array_size, &col[0]);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+}
@@ -0,0 +1,147 @@
+#ifndef MD_CPU_MD_H_INCLUDED
+#define MD_CPU_MD_H_INCLUDED
+
+#include <vector>
+
+#include "engine.hpp"
+#include "lj_simd.hpp"
+#include "thread_pool.hpp"
+
+
+// Native multithreaded engine. It runs the same physics as md.cl and serves
+// as the reference implementation. Pair forces are computed once per pair
+// from half neighbor lists (j > i) and applied to both particles, with each
+// thread accumulating into its own force array to avoid write conflicts.
+// Particle data is kept as structure-of-arrays for the SIMD pair kernels.
+class CPUMD : public Engine {
+public:
+  // A headless instance never touches GL. nthreads of 0 uses every core.
+  CPUMD(bool headless_val = false, int nthreads = 0);
+  ~CPUMD();
+
+  void loadData(const std::vector<cl_float4> &pos_val,
+                const std::vector<cl_float4> &force_val,
+                const std::vector<cl_float4> &vel_val,
+                const std::vector<cl_float4> &col_val);
+  void init(const sim_params &params);
+  void runKernel(int nsteps = 1);
+  void readState(cl_float4 *pos_out, cl_float4 *col_out);
+  void readVelocities(cl_float4 *vel_out);
+  float temperature();
+  void takeObservables(std::vector<observables> *out);
+  void setTrajectory(TrajectoryWriter *writer, int every);
+  void saveState(engine_state *out);
+  void restoreState(const engine_state &in);
+
+  // The phases of a step. Each is run on every thread of the pool.
+  void buildNeighbors(int tid, int nthreads);
+  void computeForces(int tid, int nthreads);
+  void update(int tid, int nthreads);
+  // Velocity Verlet: kickDrift before the forces, kick after.
+  void kickDrift(int tid, int nthreads);
+  void kick(int tid, int nthreads);
+  void gatherForces(int tid, int nthreads);
+  // Sum v^2 for the temperature, then apply the thermostat.
+  void kineticSum(int tid, int nthreads);
+  void applyThermostat(int tid, int nthreads);
+  // Sum the pair energies and virials for the observables.
+  void observePairs(int tid, int nthreads);
+
+private:
+  enum force_mode {
+    ALL_PAIRS,       // force_naive, force_tile.
+    ALL_PAIRS_CLIP,  // force_naive_clip, force_tile_clip.
+    NEIGHBOR_LIST    // force_cell, force_nlist.
+  };
+
+  bool headless;
+  ThreadPool pool;
+  size_t array_size;
+
+  // Positions, velocities and forces, one array per component.
+  std::vector<float> x, y, z;
+  std::vector<float> vx, vy, vz;
+  std::vector<float> fx, fy, fz;
+  // Interleaved copies of the positions and colors for the VBOs.
+  std::vector<cl_float4> pos;
+  std::vector<cl_float4> col;
+  // One force array per thread, x then y then z, summed in update.
+  std::vector<std::vector<float> > thread_force;
+
+  lj_row_fn lj_row;  // Widest pair kernel the CPU supports.
+  lj_consts consts;
+
+  force_mode mode;
+  float bound;
+  float dt;
+  float cutoff;
+  float skin;
+  float mass;
+  float elasticity;
+  bool pbc;          // Periodic box instead of walls.
+  bool verlet;       // Velocity Verlet instead of the Euler update.
+  bool have_forces;  // Verlet: the forces for the current positions are known.
+
+  // Thermostat, as on the device. See thermo in md.cl.
+  int thermostat;
+  float target_temp;
+  float tau;
+  unsigned int seed;
+  int thermo_every;
+  unsigned int step_count;
+  float temp;                    // Last measured temperature, Kelvin.
+  float thermo_scale;            // Velocity scale for this step.
+  float nh_xi;                   // Nose-Hoover friction, 1/Second.
+  std::vector<double> thread_ke; // Per-thread sums of v^2.
+  void runThermostat();
+
+  // Observables every observe_every steps, computed like the OBSERVE build
+  // of md.cl but in a separate pass over the pairs.
+  int observe_every;
+  float epsilon;
+  std::vector<double> thread_pe;   // Per-thread potential energy, Joule.
+  std::vector<double> thread_vir;  // Per-thread virial, Newton * Angstrom.
+  std::vector<observables> obs_samples;
+  void runObserve();
+
+  TrajectoryWriter *traj;
+  int traj_every;
+  void writeTrajectory();
+
+  // Uniform grid used to build the neighbor lists, as a counting sort.
+  int cell_n;                      // Cells per side.
+  float cell_size;
+  std::vector<int> cell_start;     // cell_n^3 + 1 offsets into cell_members.
+  std::vector<int> cell_members;
+
+  // Half neighbor lists. Thread t owns the lists of its chunk of particles.
+  std::vector<std::vector<int> > nlist;
+  std::vector<int> nlist_start;    // Offset into the owning thread's list.
+  std::vector<int> nlist_count;
+  std::vector<float> x_ref, y_ref, z_ref;  // Positions at the last build.
+  std::vector<char> thread_moved;  // Set if a thread saw a move > skin/2.
+  bool need_rebuild;
+
+  // Profile phases.
+  int phase_neighbor;
+  int phase_force;
+  int phase_update;
+  int phase_observe;
+
+  int cellOf(float px, float py, float pz) const;
+  // The minimum image of a displacement component with PBC.
+  float minImage(float d) const;
+  // Pieces of the update phases, each over particles [begin, end).
+  void sumForces(int begin, int end, int nthreads);
+  void halfKick(int begin, int end);
+  void drift(int begin, int end);
+  // Refresh the VBO copies and note whether any particle moved > skin/2.
+  void finishMove(int tid, int begin, int end);
+  void runNeighbors();
+  // Write the interleaved positions and colors of particles [begin, end).
+  void fillVisual(int begin, int end, cl_float4 *pos_out,
+                  cl_float4 *col_out) const;
+  void binCells();
+};
+
+#endif
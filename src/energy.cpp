@@ -0,0 +1,76 @@
+#include <math.h>
+
+
+#include "energy.hpp"
+
+
+namespace {
+
+// 4 epsilon ((sigma/r)^12 - (sigma/r)^6) from r^2, in Angstrom^2.
+double lj_potential(double r2, double sigma2, double epsilon) {
+  double s6 = sigma2 / r2;
+  s6 = s6 * s6 * s6;
+  return 4 * epsilon * (s6 * s6 - s6);
+}
+
+}
+
+
+double kineticEnergy(const std::vector<cl_float4> &vel, float mass) {
+  double sum = 0;
+  for (size_t i = 0; i < vel.size(); i++) {
+    const cl_float4 &v = vel[i];
+    sum += (double)v.s[0] * v.s[0] + (double)v.s[1] * v.s[1] +
+      (double)v.s[2] * v.s[2];
+  }
+  return 0.5 * mass * sum;
+}
+
+
+double potentialEnergy(const std::vector<cl_float4> &pos,
+                       const sim_params &params, float cutoff) {
+  double sigma2 = (double)params.sigma * params.sigma;
+  double cutoff2 = (double)cutoff * cutoff;
+  double shift = cutoff > 0 ? lj_potential(cutoff2, sigma2, params.epsilon) : 0;
+  double box = 2.0 * params.bound;
+  double sum = 0;
+  int num = pos.size();
+  for (int i = 0; i < num; i++) {
+    for (int j = i + 1; j < num; j++) {
+      double dx = pos[i].s[0] - pos[j].s[0];
+      double dy = pos[i].s[1] - pos[j].s[1];
+      double dz = pos[i].s[2] - pos[j].s[2];
+      if (params.pbc) {
+        // Minimum image.
+        dx -= box * rint(dx / box);
+        dy -= box * rint(dy / box);
+        dz -= box * rint(dz / box);
+      }
+      double r2 = dx * dx + dy * dy + dz * dz;
+      if (cutoff > 0 && r2 >= cutoff2)
+        continue;
+      if (r2 <= 1e-10)
+        continue;   // Same clamps as lj_force.
+      if (r2 < 0.01)
+        r2 = 0.01;
+      sum += lj_potential(r2, sigma2, params.epsilon) - shift;
+    }
+  }
+  return sum;
+}
+
+
+observables makeObservables(int step, double kinetic, double potential,
+                            double virial, int num, float bound) {
+  observables o;
+  o.step = step;
+  o.kinetic = kinetic;
+  o.potential = potential;
+  o.virial = virial;
+  // Equipartition over 3 degrees of freedom per particle.
+  o.temperature = 2 * kinetic / (3.0 * num * KB);
+  // Virial pressure, P V = (2 KE + sum r.F) / 3.
+  double edge = 2.0 * bound * 1e-10;  // Meter.
+  o.pressure = (2 * kinetic + virial) / (3 * edge * edge * edge);
+  return o;
+}
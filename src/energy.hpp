@@ -0,0 +1,29 @@
+#ifndef MD_ENERGY_H_INCLUDED
+#define MD_ENERGY_H_INCLUDED
+
+#include <vector>
+
+#include <CL/cl_platform.h>
+
+#include "engine.hpp"
+
+
+// Host-side energies for checking the integrators. The potential is an
+// O(N^2) pair sum, so call it only occasionally.
+
+// Kinetic energy, Joule.
+double kineticEnergy(const std::vector<cl_float4> &vel, float mass);
+
+// Lennard-Jones potential energy, Joule, with the same close-range clamp as
+// the force kernels. With a cutoff (> 0) pairs beyond it are ignored and the
+// rest shifted by the potential at the cutoff, so the energy does not jump
+// when a pair crosses it.
+double potentialEnergy(const std::vector<cl_float4> &pos,
+                       const sim_params &params, float cutoff);
+
+// Fill in the temperature and pressure of a sample from its energies and
+// virial, for num particles in a box of +-bound Angstrom.
+observables makeObservables(int step, double kinetic, double potential,
+                            double virial, int num, float bound);
+
+#endif
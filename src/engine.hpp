@@ -0,0 +1,151 @@
+#ifndef MD_ENGINE_H_INCLUDED
+#define MD_ENGINE_H_INCLUDED
+
+#include <string>
+#include <vector>
+
+#include <CL/cl_platform.h>
+
+#include "profile.hpp"
+
+
+// Parameters shared by every engine.
+struct sim_params {
+  float bound;                    // Size of the bounding box (+-), Angstrom.
+  float dt;                       // Time step, seconds.
+  float skin;                     // Extra neighbor list radius, Angstrom.
+  std::string force_kernel_name;  // Which force computation to use.
+  float sigma;                    // Lennard-Jones sigma, Angstrom.
+  float epsilon;                  // Lennard-Jones well depth, Joule(/atom).
+  float cutoff;                   // Interaction cutoff, Angstrom.
+  float mass;                     // Particle mass, Kilogram.
+  float elasticity;               // Velocity kept when bouncing off a wall.
+  std::string integrator;         // "euler" or "verlet".
+  bool pbc;                       // Periodic box instead of walls.
+  std::string thermostat;         // See thermostatId().
+  float temperature;              // Thermostat target, Kelvin.
+  float tau;                      // Thermostat coupling time, seconds.
+  int thermo_every;               // Steps between temperature readings.
+  unsigned int seed;              // Langevin noise seed.
+  int observe_every;              // Steps between observables, 0 for none.
+
+  // Defaults for the physical constants, a noble gas as in md.cl.
+  sim_params() : bound(50.f), dt(1e-15f), skin(2.f),
+                 force_kernel_name("force_naive"), sigma(4.10f),
+                 epsilon(1770 / 6.022e23f), cutoff(10.f), mass(2.18017e-25f),
+                 elasticity(0.5f), integrator("euler"), pbc(false),
+                 thermostat("none"), temperature(300.f), tau(1e-13f),
+                 thermo_every(100), seed(0), observe_every(0) {}
+};
+
+
+// Boltzmann constant, Joule/Kelvin.
+#define KB 1.380649e-23f
+
+
+// Thermostats, numbered as THERMOSTAT in md.cl. Returns -1 if unknown.
+enum { THERMO_NONE, THERMO_BERENDSEN, THERMO_LANGEVIN, THERMO_NOSE_HOOVER };
+inline int thermostatId(const std::string &name) {
+  if (name == "none")
+    return THERMO_NONE;
+  if (name == "berendsen")
+    return THERMO_BERENDSEN;
+  if (name == "langevin")
+    return THERMO_LANGEVIN;
+  if (name == "nose-hoover")
+    return THERMO_NOSE_HOOVER;
+  return -1;
+}
+
+
+// Global observables at the end of one step, SI units.
+struct observables {
+  int step;            // Steps since the start.
+  double kinetic;      // Joule.
+  double potential;    // Joule.
+  double virial;       // Sum of r.F over interacting pairs, Joule.
+  double temperature;  // Kelvin.
+  double pressure;     // Pascal, from the pair forces only.
+};
+
+
+// Force kernels ending in _fast are the plain kernel with the r^2-only pair
+// force. Returns the plain kernel's name.
+inline std::string kernelBaseName(const std::string &name) {
+  const std::string suffix = "_fast";
+  if (name.size() > suffix.size() &&
+      name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)
+    return name.substr(0, name.size() - suffix.size());
+  return name;
+}
+
+// Whether a force kernel (named without _fast) computes every pair with no
+// cutoff, or every pair clipped at the cutoff.
+inline bool allPairsKernel(const std::string &base) {
+  return base == "force_naive" || base == "force_tile" ||
+    base == "force_block" || base == "force_split";
+}
+inline bool allPairsClipKernel(const std::string &base) {
+  return base == "force_naive_clip" || base == "force_tile_clip" ||
+    base == "force_block_clip" || base == "force_split_clip";
+}
+
+
+// Everything an engine needs to continue a run where it left off.
+struct engine_state {
+  int step;                      // Steps run.
+  std::vector<cl_float4> pos;    // Angstrom.
+  std::vector<cl_float4> vel;    // Meter/Second.
+  std::vector<cl_float4> force;  // Newton, for Verlet's first kick.
+  cl_float4 thermo;              // Temperature, velocity scale and
+                                 // Nose-Hoover friction, as in md.cl.
+};
+
+
+class TrajectoryWriter;
+
+
+// Common interface for the simulation backends. The renderer only needs the
+// VBOs and the particle count.
+class Engine {
+public:
+  // The VBOs are GLuints, declared plainly so this header needs no GL.
+  unsigned int pos_vbo;  // Position vbo.
+  unsigned int col_vbo;  // Colors vbo.
+  int num;               // The number of particles.
+  Profile profile;       // Time spent in each phase of a step.
+
+  virtual ~Engine() {}
+
+  // Copy in the initial particle state.
+  virtual void loadData(const std::vector<cl_float4> &pos,
+                        const std::vector<cl_float4> &force,
+                        const std::vector<cl_float4> &vel,
+                        const std::vector<cl_float4> &col) = 0;
+  // Prepare the force and update passes. Called after loadData.
+  virtual void init(const sim_params &params) = 0;
+  // Advance the system by nsteps time steps. The VBOs are only guaranteed to
+  // be current after the last one.
+  virtual void runKernel(int nsteps = 1) = 0;
+  // Copy the current positions and colors (num each) to host memory. Only
+  // needed by headless instances, which have no VBOs to draw from.
+  virtual void readState(cl_float4 *pos, cl_float4 *col) = 0;
+  // Copy the current velocities (num, Meter/Second) to host memory.
+  virtual void readVelocities(cl_float4 *vel) = 0;
+  // The temperature (Kelvin) at the last reading, taken every thermo_every
+  // steps.
+  virtual float temperature() = 0;
+  // Append the observables sampled every observe_every steps since the last
+  // call to out, oldest first.
+  virtual void takeObservables(std::vector<observables> *out) = 0;
+  // Hand a frame to writer every `every` steps, without waiting on it.
+  virtual void setTrajectory(TrajectoryWriter *writer, int every) = 0;
+  // Copy out the state between batches. The neighbor lists are rebuilt on
+  // the next step, as they are after restoreState, so a restarted run
+  // follows the same path as the original.
+  virtual void saveState(engine_state *out) = 0;
+  // Continue from a saved state. Called after init.
+  virtual void restoreState(const engine_state &in) = 0;
+};
+
+#endif
@@ -0,0 +1,324 @@
+#include <stddef.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LJ_SIMD_X86
+#include <immintrin.h>
+#endif
+
+
+#include "lj_simd.hpp"
+
+
+// Pairs closer than 1e-5 A are the particle itself, and distances are never
+// taken below 0.1 A, as in lj_force.
+static const float min_r2 = 1e-10f;
+static const float clamp_r2 = 0.01f;
+
+
+static inline void lj_pair(const lj_soa &soa, int i, int j,
+                           const lj_consts &c, float *ax, float *ay,
+                           float *az) {
+  float dx = soa.x[i] - soa.x[j];
+  float dy = soa.y[i] - soa.y[j];
+  float dz = soa.z[i] - soa.z[j];
+  if (c.box > 0) {
+    // Minimum image.
+    dx -= c.box * rintf(dx * c.inv_box);
+    dy -= c.box * rintf(dy * c.inv_box);
+    dz -= c.box * rintf(dz * c.inv_box);
+  }
+  float r2 = dx * dx + dy * dy + dz * dz;
+  if (r2 <= min_r2 || r2 >= c.cutoff2)
+    return;
+  float inv = 1.f / (r2 > clamp_r2 ? r2 : clamp_r2);
+  float s2 = c.sigma2 * inv;
+  float s6 = s2 * s2 * s2;
+  float fs = c.scale * (2 * s6 * s6 - s6) * inv;
+  *ax += fs * dx;
+  *ay += fs * dy;
+  *az += fs * dz;
+  soa.fx[j] -= fs * dx;
+  soa.fy[j] -= fs * dy;
+  soa.fz[j] -= fs * dz;
+}
+
+
+void lj_row_scalar(const lj_soa &soa, int i, const int *js, int j0, int n,
+                   const lj_consts &c) {
+  float ax = 0.f, ay = 0.f, az = 0.f;
+  for (int k = 0; k < n; k++)
+    lj_pair(soa, i, js ? js[k] : j0 + k, c, &ax, &ay, &az);
+  soa.fx[i] += ax;
+  soa.fy[i] += ay;
+  soa.fz[i] += az;
+}
+
+
+#ifdef LJ_SIMD_X86
+
+__attribute__((target("avx2,fma")))
+static inline float hsum256(__m256 v) {
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v),
+                        _mm256_extractf128_ps(v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+
+
+// v - box * round(v / box), the minimum image of a displacement.
+__attribute__((target("avx2,fma")))
+static inline __m256 min_image256(__m256 v, __m256 box, __m256 inv_box) {
+  __m256 n = _mm256_round_ps(_mm256_mul_ps(v, inv_box),
+                             _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  return _mm256_fnmadd_ps(n, box, v);
+}
+
+
+__attribute__((target("avx2,fma")))
+void lj_row_avx2(const lj_soa &soa, int i, const int *js, int j0, int n,
+                 const lj_consts &c) {
+  const __m256 xi = _mm256_set1_ps(soa.x[i]);
+  const __m256 yi = _mm256_set1_ps(soa.y[i]);
+  const __m256 zi = _mm256_set1_ps(soa.z[i]);
+  const __m256 lo = _mm256_set1_ps(min_r2);
+  const __m256 hi = _mm256_set1_ps(c.cutoff2);
+  const __m256 clamp = _mm256_set1_ps(clamp_r2);
+  const __m256 one = _mm256_set1_ps(1.f);
+  const __m256 sigma2 = _mm256_set1_ps(c.sigma2);
+  const __m256 scale = _mm256_set1_ps(c.scale);
+  const __m256 box = _mm256_set1_ps(c.box);
+  const __m256 inv_box = _mm256_set1_ps(c.inv_box);
+  __m256 acc_x = _mm256_setzero_ps();
+  __m256 acc_y = _mm256_setzero_ps();
+  __m256 acc_z = _mm256_setzero_ps();
+
+  int k = 0;
+  for (; k + 8 <= n; k += 8) {
+    __m256i idx = _mm256_setzero_si256();
+    __m256 xj, yj, zj;
+    if (js) {
+      idx = _mm256_loadu_si256((const __m256i *)(js + k));
+      xj = _mm256_i32gather_ps(soa.x, idx, 4);
+      yj = _mm256_i32gather_ps(soa.y, idx, 4);
+      zj = _mm256_i32gather_ps(soa.z, idx, 4);
+    } else {
+      xj = _mm256_loadu_ps(soa.x + j0 + k);
+      yj = _mm256_loadu_ps(soa.y + j0 + k);
+      zj = _mm256_loadu_ps(soa.z + j0 + k);
+    }
+
+    __m256 dx = _mm256_sub_ps(xi, xj);
+    __m256 dy = _mm256_sub_ps(yi, yj);
+    __m256 dz = _mm256_sub_ps(zi, zj);
+    if (c.box > 0) {
+      dx = min_image256(dx, box, inv_box);
+      dy = min_image256(dy, box, inv_box);
+      dz = min_image256(dz, box, inv_box);
+    }
+    __m256 r2 = _mm256_mul_ps(dx, dx);
+    r2 = _mm256_fmadd_ps(dy, dy, r2);
+    r2 = _mm256_fmadd_ps(dz, dz, r2);
+    __m256 mask = _mm256_and_ps(_mm256_cmp_ps(r2, lo, _CMP_GT_OQ),
+                                _mm256_cmp_ps(r2, hi, _CMP_LT_OQ));
+    if (_mm256_movemask_ps(mask) == 0)
+      continue;
+
+    __m256 inv = _mm256_div_ps(one, _mm256_max_ps(r2, clamp));
+    __m256 s2 = _mm256_mul_ps(sigma2, inv);
+    __m256 s6 = _mm256_mul_ps(_mm256_mul_ps(s2, s2), s2);
+    // 2 * s6^2 - s6.
+    __m256 lj = _mm256_fmsub_ps(_mm256_add_ps(s6, s6), s6, s6);
+    __m256 fs = _mm256_mul_ps(_mm256_mul_ps(scale, lj), inv);
+    fs = _mm256_and_ps(fs, mask);
+
+    __m256 fx = _mm256_mul_ps(fs, dx);
+    __m256 fy = _mm256_mul_ps(fs, dy);
+    __m256 fz = _mm256_mul_ps(fs, dz);
+    acc_x = _mm256_add_ps(acc_x, fx);
+    acc_y = _mm256_add_ps(acc_y, fy);
+    acc_z = _mm256_add_ps(acc_z, fz);
+
+    if (js) {
+      // No scatter in AVX2.
+      float tx[8], ty[8], tz[8];
+      _mm256_storeu_ps(tx, fx);
+      _mm256_storeu_ps(ty, fy);
+      _mm256_storeu_ps(tz, fz);
+      for (int l = 0; l < 8; l++) {
+        int j = js[k + l];
+        soa.fx[j] -= tx[l];
+        soa.fy[j] -= ty[l];
+        soa.fz[j] -= tz[l];
+      }
+    } else {
+      float *px = soa.fx + j0 + k;
+      float *py = soa.fy + j0 + k;
+      float *pz = soa.fz + j0 + k;
+      _mm256_storeu_ps(px, _mm256_sub_ps(_mm256_loadu_ps(px), fx));
+      _mm256_storeu_ps(py, _mm256_sub_ps(_mm256_loadu_ps(py), fy));
+      _mm256_storeu_ps(pz, _mm256_sub_ps(_mm256_loadu_ps(pz), fz));
+    }
+  }
+
+  float ax = hsum256(acc_x), ay = hsum256(acc_y), az = hsum256(acc_z);
+  for (; k < n; k++)
+    lj_pair(soa, i, js ? js[k] : j0 + k, c, &ax, &ay, &az);
+  soa.fx[i] += ax;
+  soa.fy[i] += ay;
+  soa.fz[i] += az;
+}
+
+
+// Written out rather than _mm512_reduce_add_ps, which trips -Wuninitialized
+// inside the GCC headers.
+__attribute__((target("avx512f")))
+static inline float hsum512(__m512 v) {
+  float lanes[16];
+  _mm512_storeu_ps(lanes, v);
+  float sum = 0.f;
+  for (int l = 0; l < 16; l++)
+    sum += lanes[l];
+  return sum;
+}
+
+
+__attribute__((target("avx512f")))
+static inline __m512 min_image512(__m512 v, __m512 box, __m512 inv_box) {
+  __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(v, inv_box),
+                                  _MM_FROUND_TO_NEAREST_INT |
+                                  _MM_FROUND_NO_EXC);
+  return _mm512_fnmadd_ps(n, box, v);
+}
+
+
+__attribute__((target("avx512f")))
+void lj_row_avx512(const lj_soa &soa, int i, const int *js, int j0, int n,
+                   const lj_consts &c) {
+  const __m512 xi = _mm512_set1_ps(soa.x[i]);
+  const __m512 yi = _mm512_set1_ps(soa.y[i]);
+  const __m512 zi = _mm512_set1_ps(soa.z[i]);
+  const __m512 lo = _mm512_set1_ps(min_r2);
+  const __m512 hi = _mm512_set1_ps(c.cutoff2);
+  const __m512 clamp = _mm512_set1_ps(clamp_r2);
+  const __m512 one = _mm512_set1_ps(1.f);
+  const __m512 sigma2 = _mm512_set1_ps(c.sigma2);
+  const __m512 scale = _mm512_set1_ps(c.scale);
+  const __m512 box = _mm512_set1_ps(c.box);
+  const __m512 inv_box = _mm512_set1_ps(c.inv_box);
+  const __m512 zero = _mm512_setzero_ps();
+  __m512 acc_x = zero, acc_y = zero, acc_z = zero;
+
+  for (int k = 0; k < n; k += 16) {
+    // The tail is handled with a partial lane mask rather than scalar code.
+    int rem = n - k;
+    __mmask16 lanes = rem >= 16 ? (__mmask16)0xFFFF
+                                : (__mmask16)((1u << rem) - 1);
+    __m512i idx = _mm512_setzero_si512();
+    __m512 xj, yj, zj;
+    if (js) {
+      idx = _mm512_maskz_loadu_epi32(lanes, js + k);
+      xj = _mm512_mask_i32gather_ps(zero, lanes, idx, soa.x, 4);
+      yj = _mm512_mask_i32gather_ps(zero, lanes, idx, soa.y, 4);
+      zj = _mm512_mask_i32gather_ps(zero, lanes, idx, soa.z, 4);
+    } else {
+      xj = _mm512_maskz_loadu_ps(lanes, soa.x + j0 + k);
+      yj = _mm512_maskz_loadu_ps(lanes, soa.y + j0 + k);
+      zj = _mm512_maskz_loadu_ps(lanes, soa.z + j0 + k);
+    }
+
+    __m512 dx = _mm512_sub_ps(xi, xj);
+    __m512 dy = _mm512_sub_ps(yi, yj);
+    __m512 dz = _mm512_sub_ps(zi, zj);
+    if (c.box > 0) {
+      dx = min_image512(dx, box, inv_box);
+      dy = min_image512(dy, box, inv_box);
+      dz = min_image512(dz, box, inv_box);
+    }
+    __m512 r2 = _mm512_mul_ps(dx, dx);
+    r2 = _mm512_fmadd_ps(dy, dy, r2);
+    r2 = _mm512_fmadd_ps(dz, dz, r2);
+    __mmask16 m = lanes & _mm512_cmp_ps_mask(r2, lo, _CMP_GT_OQ) &
+      _mm512_cmp_ps_mask(r2, hi, _CMP_LT_OQ);
+    if (m == 0)
+      continue;
+
+    __m512 inv = _mm512_div_ps(one, _mm512_maskz_max_ps(0xFFFF, r2, clamp));
+    __m512 s2 = _mm512_mul_ps(sigma2, inv);
+    __m512 s6 = _mm512_mul_ps(_mm512_mul_ps(s2, s2), s2);
+    __m512 lj = _mm512_fmsub_ps(_mm512_add_ps(s6, s6), s6, s6);
+    __m512 fs = _mm512_maskz_mul_ps(m, _mm512_mul_ps(scale, lj), inv);
+
+    __m512 fx = _mm512_mul_ps(fs, dx);
+    __m512 fy = _mm512_mul_ps(fs, dy);
+    __m512 fz = _mm512_mul_ps(fs, dz);
+    acc_x = _mm512_add_ps(acc_x, fx);
+    acc_y = _mm512_add_ps(acc_y, fy);
+    acc_z = _mm512_add_ps(acc_z, fz);
+
+    if (js) {
+      // Partners are distinct, so the scatter has no conflicts.
+      __m512 gx = _mm512_mask_i32gather_ps(zero, m, idx, soa.fx, 4);
+      __m512 gy = _mm512_mask_i32gather_ps(zero, m, idx, soa.fy, 4);
+      __m512 gz = _mm512_mask_i32gather_ps(zero, m, idx, soa.fz, 4);
+      _mm512_mask_i32scatter_ps(soa.fx, m, idx, _mm512_sub_ps(gx, fx), 4);
+      _mm512_mask_i32scatter_ps(soa.fy, m, idx, _mm512_sub_ps(gy, fy), 4);
+      _mm512_mask_i32scatter_ps(soa.fz, m, idx, _mm512_sub_ps(gz, fz), 4);
+    } else {
+      float *px = soa.fx + j0 + k;
+      float *py = soa.fy + j0 + k;
+      float *pz = soa.fz + j0 + k;
+      _mm512_mask_storeu_ps(px, m,
+                            _mm512_sub_ps(_mm512_maskz_loadu_ps(m, px), fx));
+      _mm512_mask_storeu_ps(py, m,
+                            _mm512_sub_ps(_mm512_maskz_loadu_ps(m, py), fy));
+      _mm512_mask_storeu_ps(pz, m,
+                            _mm512_sub_ps(_mm512_maskz_loadu_ps(m, pz), fz));
+    }
+  }
+
+  soa.fx[i] += hsum512(acc_x);
+  soa.fy[i] += hsum512(acc_y);
+  soa.fz[i] += hsum512(acc_z);
+}
+
+
+lj_row_fn lj_row_select(const char **name) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    if (name)
+      *name = "AVX-512";
+    return lj_row_avx512;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    if (name)
+      *name = "AVX2";
+    return lj_row_avx2;
+  }
+  if (name)
+    *name = "scalar";
+  return lj_row_scalar;
+}
+
+#else
+
+void lj_row_avx2(const lj_soa &soa, int i, const int *js, int j0, int n,
+                 const lj_consts &c) {
+  lj_row_scalar(soa, i, js, j0, n, c);
+}
+
+
+void lj_row_avx512(const lj_soa &soa, int i, const int *js, int j0, int n,
+                   const lj_consts &c) {
+  lj_row_scalar(soa, i, js, j0, n, c);
+}
+
+
+lj_row_fn lj_row_select(const char **name) {
+  if (name)
+    *name = "scalar";
+  return lj_row_scalar;
+}
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef MD_LJ_SIMD_H_INCLUDED
+#define MD_LJ_SIMD_H_INCLUDED
+
+
+// Constants for the pair kernels, precomputed from the physical parameters.
+struct lj_consts {
+  float sigma2;   // sigma^2, Angstrom^2.
+  float scale;    // 24 * epsilon / 1e-10, so forces come out in Newton.
+  float cutoff2;  // Pairs at or beyond this squared distance are skipped.
+  float box;      // Periodic box edge for the minimum image, 0 with walls.
+  float inv_box;  // 1 / box.
+};
+
+
+// Structure-of-arrays particle data for the host pair kernels. The force
+// arrays are accumulated into, not overwritten.
+struct lj_soa {
+  const float *x, *y, *z;
+  float *fx, *fy, *fz;
+};
+
+
+// Evaluate the same force as lj_force in md.cl between particle i and n
+// partners, add it to particle i and subtract it from each partner (Newton's
+// third law). The partners are js[0..n) or, if js is NULL, the contiguous
+// range j0..j0+n. Partners must be distinct.
+typedef void (*lj_row_fn)(const lj_soa &soa, int i, const int *js, int j0,
+                          int n, const lj_consts &c);
+
+void lj_row_scalar(const lj_soa &soa, int i, const int *js, int j0, int n,
+                   const lj_consts &c);
+void lj_row_avx2(const lj_soa &soa, int i, const int *js, int j0, int n,
+                 const lj_consts &c);
+void lj_row_avx512(const lj_soa &soa, int i, const int *js, int j0, int n,
+                   const lj_consts &c);
+
+// Pick the widest implementation this CPU supports. If name is not NULL it
+// is set to a description of the choice.
+lj_row_fn lj_row_select(const char **name);
+
+#endif
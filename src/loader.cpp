@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// GLuint, for util.hpp.
+#include <GL/gl.h>
+
+
+#include "loader.hpp"
+#include "thread_pool.hpp"
+#include "traj_reader.hpp"
+#include "util.hpp"
+
+
+namespace {
+
+bool endsWith(const std::string &s, const std::string &suffix) {
+  return s.size() >= suffix.size() &&
+    s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+
+bool loadXYZ(const std::string &path, std::vector<cl_float4> *pos,
+             std::vector<cl_float4> *vel) {
+  FILE *f = fopen(path.c_str(), "r");
+  if (!f) {
+    perror(path.c_str());
+    return false;
+  }
+  char line[1024];
+  long num = 0;
+  if (fgets(line, sizeof(line), f))
+    num = strtol(line, NULL, 10);
+  // Skip the comment.
+  bool ok = num > 0 && fgets(line, sizeof(line), f);
+  pos->resize(ok ? num : 0);
+  bool velocities = false;
+  for (long i = 0; ok && i < num; i++) {
+    if (!fgets(line, sizeof(line), f)) {
+      ok = false;
+      break;
+    }
+    // Element, then the numbers.
+    char *p = line + strspn(line, " \t");
+    p += strcspn(p, " \t");
+    float v[6];
+    int n = 0;
+    for (char *end; n < 6; n++, p = end) {
+      v[n] = strtof(p, &end);
+      if (end == p)
+        break;
+    }
+    if (n < 3) {
+      ok = false;
+      break;
+    }
+    (*pos)[i] = f4(v[0], v[1], v[2], 1.f);
+    if (i == 0 && n == 6) {
+      velocities = true;
+      vel->resize(num);
+    }
+    if (velocities)
+      (*vel)[i] = n == 6 ? f4(v[3], v[4], v[5], 0.f) : f4(0.f, 0.f, 0.f, 0.f);
+  }
+  fclose(f);
+  if (!ok)
+    printf("ERROR: %s is not a valid XYZ file\n", path.c_str());
+  return ok;
+}
+
+
+bool loadPDB(const std::string &path, std::vector<cl_float4> *pos,
+             std::vector<cl_float4> *vel) {
+  FILE *f = fopen(path.c_str(), "r");
+  if (!f) {
+    perror(path.c_str());
+    return false;
+  }
+  char line[1024];
+  while (fgets(line, sizeof(line), f)) {
+    if (strncmp(line, "ENDMDL", 6) == 0)
+      break;
+    if (strncmp(line, "ATOM  ", 6) != 0 && strncmp(line, "HETATM", 6) != 0)
+      continue;
+    // Fixed columns: x 31-38, y 39-46, z 47-54.
+    if (strlen(line) < 54) {
+      printf("ERROR: short PDB record in %s: %s", path.c_str(), line);
+      fclose(f);
+      return false;
+    }
+    float c[3];
+    for (int k = 0; k < 3; k++) {
+      char field[9];
+      memcpy(field, line + 30 + 8 * k, 8);
+      field[8] = '\0';
+      c[k] = strtof(field, NULL);
+    }
+    pos->push_back(f4(c[0], c[1], c[2], 1.f));
+  }
+  fclose(f);
+  vel->clear();
+  if (pos->empty())
+    printf("ERROR: no ATOM records in %s\n", path.c_str());
+  return !pos->empty();
+}
+
+
+// Widens x, y, z floats to cl_float4, each thread taking a chunk.
+class Widen : public ThreadPool::Task {
+public:
+  Widen(const float *in_val, cl_float4 *out_val, int num_val, float w_val)
+    : in(in_val), out(out_val), num(num_val), w(w_val) {}
+  void run(int tid, int nthreads) {
+    int begin, end;
+    ThreadPool::range(num, tid, nthreads, &begin, &end);
+    for (int i = begin; i < end; i++)
+      out[i] = f4(in[3 * i], in[3 * i + 1], in[3 * i + 2], w);
+  }
+private:
+  const float *in;
+  cl_float4 *out;
+  int num;
+  float w;
+};
+
+
+bool loadBinary(const std::string &path, std::vector<cl_float4> *pos,
+                std::vector<cl_float4> *vel) {
+  TrajectoryReader reader;
+  if (!reader.open(path))
+    return false;
+  if (reader.frames() == 0) {
+    printf("ERROR: %s has no frames\n", path.c_str());
+    return false;
+  }
+  size_t k = reader.frames() - 1;
+  int num = reader.num();
+  printf("Loading step %d of %s (%d particles).\n", reader.step(k),
+         path.c_str(), num);
+
+  // Raw frames are widened straight from the map.
+  std::vector<float> xyz, xyz_vel;
+  TrajectoryReader::frame_view f;
+  if (!reader.view(k, &f)) {
+    if (!reader.read(k, &xyz, &xyz_vel))
+      return false;
+    f.pos = &xyz[0];
+    f.vel = reader.velocities() ? &xyz_vel[0] : NULL;
+  }
+  ThreadPool pool;
+  pos->resize(num);
+  Widen widen_pos(f.pos, &(*pos)[0], num, 1.f);
+  pool.run(&widen_pos);
+  if (f.vel) {
+    vel->resize(num);
+    Widen widen_vel(f.vel, &(*vel)[0], num, 0.f);
+    pool.run(&widen_vel);
+  }
+  return true;
+}
+
+}
+
+
+bool loadConfiguration(const std::string &path, std::vector<cl_float4> *pos,
+                       std::vector<cl_float4> *vel) {
+  pos->clear();
+  vel->clear();
+  if (endsWith(path, ".xyz"))
+    return loadXYZ(path, pos, vel);
+  if (endsWith(path, ".pdb"))
+    return loadPDB(path, pos, vel);
+  return loadBinary(path, pos, vel);
+}
@@ -0,0 +1,24 @@
+#ifndef MD_LOADER_H_INCLUDED
+#define MD_LOADER_H_INCLUDED
+
+#include <string>
+#include <vector>
+
+#include <CL/cl_platform.h>
+
+
+// Initial configurations from disk, in Angstrom and Meter/Second.
+//
+//  .xyz  A count line, a comment line, then "element x y z [vx vy vz]" per
+//        particle.
+//  .pdb  The ATOM and HETATM records of the first model.
+//  else  A binary trajectory as written by --traj (see traj_format.hpp),
+//        raw or compressed, whose last frame is used. The file is
+//        memory-mapped and raw frames are converted in parallel.
+//
+// Positions get w = 1. vel is left empty if the file has no velocities.
+// Prints the reason and returns false on failure.
+bool loadConfiguration(const std::string &path, std::vector<cl_float4> *pos,
+                       std::vector<cl_float4> *vel);
+
+#endif
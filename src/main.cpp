@@ -5,9 +5,11 @@
 #include <iostream>
 #include <sstream>
 #include <iomanip>
+#include <algorithm>
 #include <math.h>
 #include <time.h>
 #include <semaphore.h>
+#include <pthread.h>
 
 
 // OpenGL stuff.
@@ -19,16 +21,63 @@
 
 // Other local includes.
 #include "md.hpp"
+#include "checkpoint.hpp"
+#include "cpu_md.hpp"
 #include "cycle_timer.hpp"
+#include "energy.hpp"
+#include "loader.hpp"
+#include "snapshot.hpp"
+#include "trajectory.hpp"
 #include "util.hpp"
 
 
 #define CHECK(A, B) (assert((A) == (B)))
+// Minimum time between rendered frames, ms.
+#define FRAME_MS 50
+// Adaptive batches aim to take this long, ms, so rendering stays smooth.
+#define BATCH_MS (FRAME_MS / 2)
+// Avogadro's number, for epsilon given per mole.
+#define AVOGADRO 6.022e23f
+
+
+// Long options without a short form.
+enum {
+  OPT_SIGMA = 256,
+  OPT_EPSILON,
+  OPT_CUTOFF,
+  OPT_MASS,
+  OPT_ELASTICITY,
+  OPT_FAST_MATH,
+  OPT_VALIDATE,
+  OPT_INTEGRATOR,
+  OPT_ENERGY,
+  OPT_PBC,
+  OPT_THERMOSTAT,
+  OPT_TEMP,
+  OPT_TAU,
+  OPT_THERMO_EVERY,
+  OPT_OBSERVE,
+  OPT_TRAJ,
+  OPT_TRAJ_EVERY,
+  OPT_TRAJ_VELOCITIES,
+  OPT_TRAJ_PRECISION,
+  OPT_CHECKPOINT,
+  OPT_CHECKPOINT_EVERY,
+  OPT_RESTART,
+  OPT_INPUT,
+  OPT_AUTOTUNE,
+  OPT_IBLOCK,
+  OPT_JSPLIT
+};
 
 
 static struct prog_state {
   // Class instance.
-  MD *md;
+  Engine *md;
+  // Set when the engine runs on its own thread and hands over snapshots.
+  Snapshot *snapshot;
+  pthread_t sim_thread;
+  volatile bool sim_running;
   // GL related variables.
   int window_width;
   int window_height;
@@ -37,6 +86,8 @@ static struct prog_state {
   int mouse_old_x, mouse_old_y;
   int mouse_buttons;
   float rotate_x, rotate_y;
+  GLuint pos_vbo;  // What appRender draws, either the engine's VBOs or ours.
+  GLuint col_vbo;
   // Internal variables and parameters.
   double t0;
   double tlast;
@@ -48,6 +99,40 @@ static struct prog_state {
   int group_size;
   float dt;
   std::string force_kernel_name;
+  float skin;
+  bool headless;
+  int steps;
+  std::string engine;
+  int threads;
+  unsigned int seed;
+  int warmup;
+  std::string report;
+  int steps_per_frame;  // Steps per runKernel call, 0 adapts to BATCH_MS.
+  int batch;            // Current number of steps per runKernel call.
+  int steps_done;       // Steps since the last framerate update.
+  int steprate;
+  bool interop;         // Step from a GLUT timer straight into shared VBOs.
+  bool program_cache;   // Reuse OpenCL program binaries from disk.
+  sim_params params;    // Physical constants, compiled into the kernels.
+  bool fast_math;       // Build the kernels with relaxed math.
+  int iblock;           // Particles per work-item in force_block.
+  int jsplit;           // Slices per particle in force_split, 0 for auto.
+  bool validate;        // Check the force kernel against the reference.
+  bool energy;          // Report the total energy and its drift.
+  observables obs;      // Latest on-device observables sample.
+  bool have_obs;
+  std::string traj;     // Trajectory file, none if empty.
+  int traj_every;       // Steps between trajectory frames.
+  bool traj_velocities; // Also write velocities.
+  float traj_precision; // Compressed position grid (A), 0 for floats.
+  TrajectoryWriter *traj_writer;
+  int step;             // Steps run, including those before a restart.
+  std::string checkpoint;  // Checkpoint file, none if empty.
+  int checkpoint_every;    // Steps between checkpoints, 0 for only at exit.
+  std::string restart;     // Checkpoint to continue from.
+  CheckpointWriter *checkpoint_writer;
+  std::string input;       // Initial configuration, random if empty.
+  bool autotune;           // Pick the force kernel and group size by timing.
 } prog_state;
 
 sem_t lock;
@@ -63,6 +148,16 @@ void appKeyboard(unsigned char key, int x, int y);
 void appMouse(int button, int state, int x, int y);
 
 void appMotion(int x, int y);
+void run_headless();
+int run_batch(int max_steps);
+void *sim_loop(void *arg);
+double total_energy(double *kinetic, double *potential);
+const std::string &stats();
+std::string step_stats();
+std::string save_settings();
+void load_settings(const std::string &settings);
+void write_checkpoint();
+void finish_output();
 
 
 // Quick random function to distribute our initial points.
@@ -90,6 +185,39 @@ void set_default_state () {
   prog_state.group_size = 32;
   prog_state.dt = 1e-15;
   prog_state.force_kernel_name = std::string("force_naive");
+  prog_state.skin = 2.f;
+  prog_state.headless = false;
+  prog_state.steps = 1000;
+  prog_state.engine = std::string("cl");
+  prog_state.threads = 0;
+  prog_state.seed = 0;
+  prog_state.warmup = 0;
+  prog_state.report = std::string("");
+  prog_state.steps_per_frame = 0;
+  prog_state.batch = 1;
+  prog_state.steps_done = 0;
+  prog_state.steprate = 0;
+  prog_state.interop = false;
+  prog_state.program_cache = true;
+  prog_state.params = sim_params();
+  prog_state.fast_math = false;
+  prog_state.iblock = 4;
+  prog_state.jsplit = 0;
+  prog_state.validate = false;
+  prog_state.autotune = false;
+  prog_state.energy = false;
+  prog_state.have_obs = false;
+  prog_state.traj = std::string("");
+  prog_state.traj_every = 100;
+  prog_state.traj_velocities = false;
+  prog_state.traj_precision = 0.f;
+  prog_state.traj_writer = NULL;
+  prog_state.step = 0;
+  prog_state.checkpoint = std::string("");
+  prog_state.checkpoint_every = 10000;
+  prog_state.restart = std::string("");
+  prog_state.checkpoint_writer = NULL;
+  prog_state.snapshot = NULL;
 }
 
 
@@ -111,28 +239,142 @@ void usage(const char* progname) {
          prog_state.dt);
   printf("  -k  --force-kernel <STR>  Force kernel to use        default=%s\n",
          prog_state.force_kernel_name.c_str());
+  printf("  -s  --skin <FLOAT>        Neighbor list skin (A)     default=%f\n",
+         prog_state.skin);
+  printf("  -H  --headless            Run without a window       default=%s\n",
+         prog_state.headless ? "on" : "off");
+  printf("  -S  --steps <INT>         Steps to run if headless   default=%d\n",
+         prog_state.steps);
+  printf("  -e  --engine <STR>        cl or cpu                  default=%s\n",
+         prog_state.engine.c_str());
+  printf("  -j  --threads <INT>       CPU engine threads, 0=all  default=%d\n",
+         prog_state.threads);
+  printf("  -R  --seed <INT>          Random seed, 0=time        default=%u\n",
+         prog_state.seed);
+  printf("  -W  --warmup <INT>        Untimed steps if headless  default=%d\n",
+         prog_state.warmup);
+  printf("  -o  --report <FILE>       Append headless CSV row    default=%s\n",
+         "none");
+  printf("  -I  --gl-interop          Step on the GL thread      default=%s\n",
+         prog_state.interop ? "on" : "off");
+  printf("      --sigma <FLOAT>       Lennard-Jones sigma (A)    default=%f\n",
+         prog_state.params.sigma);
+  printf("      --epsilon <FLOAT>     Well depth (J/mol)         default=%f\n",
+         prog_state.params.epsilon * AVOGADRO);
+  printf("      --cutoff <FLOAT>      Interaction cutoff (A)     default=%f\n",
+         prog_state.params.cutoff);
+  printf("      --mass <FLOAT>        Particle mass (kg)         default=%e\n",
+         prog_state.params.mass);
+  printf("      --elasticity <FLOAT>  Wall restitution           default=%f\n",
+         prog_state.params.elasticity);
+  printf("      --fast-math           Relaxed-math kernel build  default=%s\n",
+         prog_state.fast_math ? "on" : "off");
+  printf("      --iblock <INT>        force_block particles/item default=%d\n",
+         prog_state.iblock);
+  printf("      --jsplit <INT>        force_split slices, 0=auto default=%d\n",
+         prog_state.jsplit);
+  printf("      --validate            Report the force error     default=%s\n",
+         prog_state.validate ? "on" : "off");
+  printf("      --autotune            Time kernels, group sizes  default=%s\n",
+         prog_state.autotune ? "on" : "off");
+  printf("      --integrator <STR>    euler or verlet            default=%s\n",
+         prog_state.params.integrator.c_str());
+  printf("      --energy              Report energy drift        default=%s\n",
+         prog_state.energy ? "on" : "off");
+  printf("      --pbc                 Periodic box, no walls     default=%s\n",
+         prog_state.params.pbc ? "on" : "off");
+  printf("      --thermostat <STR>    Temperature control        default=%s\n",
+         prog_state.params.thermostat.c_str());
+  printf("      --temp <FLOAT>        Thermostat target (K)      default=%f\n",
+         prog_state.params.temperature);
+  printf("      --tau <FLOAT>         Thermostat coupling (fs)   default=%f\n",
+         prog_state.params.tau * 1e15f);
+  printf("      --thermo-every <INT>  Steps between T readings   default=%d\n",
+         prog_state.params.thermo_every);
+  printf("      --observe <INT>       Steps between observables  default=%d\n",
+         prog_state.params.observe_every);
+  printf("      --traj <FILE>         Write a binary trajectory  default=%s\n",
+         prog_state.traj.empty() ? "none" : prog_state.traj.c_str());
+  printf("      --traj-every <INT>    Steps between frames       default=%d\n",
+         prog_state.traj_every);
+  printf("      --traj-velocities     Add velocities to frames   default=%s\n",
+         prog_state.traj_velocities ? "on" : "off");
+  printf("      --traj-precision <FLOAT>\n");
+  printf("                            Compress to this grid (A)  default=%s\n",
+         "off");
+  printf("      --checkpoint <FILE>   Save the state for restart default=%s\n",
+         prog_state.checkpoint.empty() ? "none" :
+         prog_state.checkpoint.c_str());
+  printf("      --checkpoint-every <INT>\n");
+  printf("                            Steps between checkpoints  default=%d\n",
+         prog_state.checkpoint_every);
+  printf("      --restart <FILE>      Continue from a checkpoint default=%s\n",
+         prog_state.restart.empty() ? "none" : prog_state.restart.c_str());
+  printf("      --input <FILE>        XYZ, PDB or trajectory     default=%s\n",
+         prog_state.input.empty() ? "random" : prog_state.input.c_str());
+  printf("  -C  --no-cache            Always compile from source default=%s\n",
+         prog_state.program_cache ? "off" : "on");
+  printf("  -K  --steps-per-frame <INT>\n");
+  printf("                            Steps per batch, 0=adapt   default=%d\n",
+         prog_state.steps_per_frame);
   printf("  -?  --help                This message\n");
 }
 
 
 int main(int argc, char** argv) {
   set_default_state();
-  srandom(time(NULL));
 
   int opt;
   static struct option long_options[] = {
     {"help",     0, 0,  '?'},
-    {"width",    0, 0,  'w'},
-    {"height",   0, 0,  'h'},
-    {"nparticles",     0, 0,  'n'},
-    {"bbox",      0, 0,  'b'},
-    {"group-size",     0, 0,  'g'},
-    {"dt",       0, 0,  't'},
-    {"force-kernel",  0, 0,   'k'},
+    {"width",    1, 0,  'w'},
+    {"height",   1, 0,  'h'},
+    {"nparticles",     1, 0,  'n'},
+    {"bbox",      1, 0,  'b'},
+    {"group-size",     1, 0,  'g'},
+    {"dt",       1, 0,  't'},
+    {"force-kernel",  1, 0,   'k'},
+    {"skin",     1, 0,  's'},
+    {"headless", 0, 0,  'H'},
+    {"steps",    1, 0,  'S'},
+    {"engine",   1, 0,  'e'},
+    {"threads",  1, 0,  'j'},
+    {"seed",     1, 0,  'R'},
+    {"warmup",   1, 0,  'W'},
+    {"report",   1, 0,  'o'},
+    {"steps-per-frame", 1, 0, 'K'},
+    {"gl-interop", 0, 0,  'I'},
+    {"no-cache", 0, 0,    'C'},
+    {"sigma",    1, 0,  OPT_SIGMA},
+    {"epsilon",  1, 0,  OPT_EPSILON},
+    {"cutoff",   1, 0,  OPT_CUTOFF},
+    {"mass",     1, 0,  OPT_MASS},
+    {"elasticity", 1, 0, OPT_ELASTICITY},
+    {"fast-math", 0, 0, OPT_FAST_MATH},
+    {"validate", 0, 0,  OPT_VALIDATE},
+    {"integrator", 1, 0, OPT_INTEGRATOR},
+    {"energy",   0, 0,  OPT_ENERGY},
+    {"pbc",      0, 0,  OPT_PBC},
+    {"thermostat", 1, 0, OPT_THERMOSTAT},
+    {"temp",     1, 0,  OPT_TEMP},
+    {"tau",      1, 0,  OPT_TAU},
+    {"thermo-every", 1, 0, OPT_THERMO_EVERY},
+    {"observe",  1, 0,  OPT_OBSERVE},
+    {"traj",     1, 0,  OPT_TRAJ},
+    {"traj-every", 1, 0, OPT_TRAJ_EVERY},
+    {"traj-velocities", 0, 0, OPT_TRAJ_VELOCITIES},
+    {"traj-precision", 1, 0, OPT_TRAJ_PRECISION},
+    {"checkpoint", 1, 0, OPT_CHECKPOINT},
+    {"checkpoint-every", 1, 0, OPT_CHECKPOINT_EVERY},
+    {"restart",  1, 0,  OPT_RESTART},
+    {"input",    1, 0,  OPT_INPUT},
+    {"autotune", 0, 0,  OPT_AUTOTUNE},
+    {"iblock",   1, 0,  OPT_IBLOCK},
+    {"jsplit",   1, 0,  OPT_JSPLIT},
     {0 ,0, 0, 0}
   };
 
-  while ((opt = getopt_long(argc, argv, "w:h:n:b:g:t:k:?", long_options, NULL))
+  while ((opt = getopt_long(argc, argv, "w:h:n:b:g:t:k:s:HS:e:j:R:W:o:K:IC?", long_options, NULL))
          != EOF) {
     switch (opt) {
     case 'w':
@@ -157,6 +399,117 @@ int main(int argc, char** argv) {
     case 'k':
       prog_state.force_kernel_name = std::string(optarg);
       break;
+    case 's':
+      prog_state.skin = atof(optarg);
+      break;
+    case 'H':
+      prog_state.headless = true;
+      break;
+    case 'S':
+      prog_state.steps = atoi(optarg);
+      break;
+    case 'e':
+      prog_state.engine = std::string(optarg);
+      break;
+    case 'j':
+      prog_state.threads = atoi(optarg);
+      break;
+    case 'R':
+      prog_state.seed = strtoul(optarg, NULL, 10);
+      break;
+    case 'W':
+      prog_state.warmup = atoi(optarg);
+      break;
+    case 'o':
+      prog_state.report = std::string(optarg);
+      break;
+    case 'K':
+      prog_state.steps_per_frame = atoi(optarg);
+      break;
+    case 'I':
+      prog_state.interop = true;
+      break;
+    case 'C':
+      prog_state.program_cache = false;
+      break;
+    case OPT_SIGMA:
+      prog_state.params.sigma = atof(optarg);
+      break;
+    case OPT_EPSILON:
+      prog_state.params.epsilon = atof(optarg) / AVOGADRO;
+      break;
+    case OPT_CUTOFF:
+      prog_state.params.cutoff = atof(optarg);
+      break;
+    case OPT_MASS:
+      prog_state.params.mass = atof(optarg);
+      break;
+    case OPT_ELASTICITY:
+      prog_state.params.elasticity = atof(optarg);
+      break;
+    case OPT_FAST_MATH:
+      prog_state.fast_math = true;
+      break;
+    case OPT_VALIDATE:
+      prog_state.validate = true;
+      break;
+    case OPT_INTEGRATOR:
+      prog_state.params.integrator = std::string(optarg);
+      break;
+    case OPT_ENERGY:
+      prog_state.energy = true;
+      break;
+    case OPT_PBC:
+      prog_state.params.pbc = true;
+      break;
+    case OPT_THERMOSTAT:
+      prog_state.params.thermostat = std::string(optarg);
+      break;
+    case OPT_TEMP:
+      prog_state.params.temperature = atof(optarg);
+      break;
+    case OPT_TAU:
+      prog_state.params.tau = atof(optarg) * 1e-15f;
+      break;
+    case OPT_THERMO_EVERY:
+      prog_state.params.thermo_every = atoi(optarg);
+      break;
+    case OPT_OBSERVE:
+      prog_state.params.observe_every = atoi(optarg);
+      break;
+    case OPT_TRAJ:
+      prog_state.traj = std::string(optarg);
+      break;
+    case OPT_TRAJ_EVERY:
+      prog_state.traj_every = atoi(optarg);
+      break;
+    case OPT_TRAJ_VELOCITIES:
+      prog_state.traj_velocities = true;
+      break;
+    case OPT_TRAJ_PRECISION:
+      prog_state.traj_precision = atof(optarg);
+      break;
+    case OPT_CHECKPOINT:
+      prog_state.checkpoint = std::string(optarg);
+      break;
+    case OPT_CHECKPOINT_EVERY:
+      prog_state.checkpoint_every = atoi(optarg);
+      break;
+    case OPT_RESTART:
+      prog_state.restart = std::string(optarg);
+      break;
+    case OPT_INPUT:
+      prog_state.input = std::string(optarg);
+      break;
+    case OPT_AUTOTUNE:
+      prog_state.autotune = true;
+      break;
+    case OPT_IBLOCK:
+      prog_state.iblock = atoi(optarg);
+      break;
+    case OPT_JSPLIT:
+      prog_state.jsplit = atoi(optarg);
+      break;
     case '?':
     default:
       usage(argv[0]);
@@ -164,62 +517,225 @@ int main(int argc, char** argv) {
     }
   }
 
-  if (prog_state.nparticles % prog_state.group_size != 0) {
-    std::cout
-      << "ERROR: The group size must evenly divide the number of particles."
-      << std::endl;
+  // A restarted run takes its settings from the checkpoint, so it continues
+  // exactly as the original would have.
+  checkpoint restart;
+  if (!prog_state.restart.empty()) {
+    if (!checkpointLoad(prog_state.restart, &restart))
+      exit(EXIT_FAILURE);
+    load_settings(restart.settings);
+    printf("Restarting from %s at step %d.\n", prog_state.restart.c_str(),
+           restart.state.step);
+  }
+
+  // A fixed seed gives the same initial state every run, for benchmarking.
+  // It seeds the Langevin noise as well.
+  unsigned int seed = prog_state.seed ? prog_state.seed : time(NULL);
+  srandom(seed);
+  prog_state.params.seed = seed;
+
+  // The particle count comes from the input file, if any.
+  std::vector<cl_float4> input_pos, input_vel;
+  if (!prog_state.input.empty() && prog_state.restart.empty()) {
+    if (!loadConfiguration(prog_state.input, &input_pos, &input_vel))
+      exit(EXIT_FAILURE);
+    prog_state.nparticles = input_pos.size();
+    float bound = prog_state.bbox;
+    size_t outside = 0;
+    for (size_t i = 0; i < input_pos.size(); i++)
+      for (int k = 0; k < 3; k++)
+        if (fabsf(input_pos[i].s[k]) > bound) {
+          outside++;
+          break;
+        }
+    if (outside)
+      printf("WARNING: %zu particles of %s lie outside the box (+-%f).\n",
+             outside, prog_state.input.c_str(), bound);
+  }
+
+  // A restarted run keeps the kernel and group size it was saved with.
+  if (!prog_state.restart.empty())
+    prog_state.autotune = false;
+  if (prog_state.autotune && prog_state.engine != "cl") {
+    std::cout << "ERROR: --autotune needs the cl engine." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  // Any particle count runs at any group size; the kernels are launched
+  // over whole groups and skip the padding.
+  if (prog_state.group_size < 1) {
+    std::cout << "ERROR: The group size must be positive." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (prog_state.iblock != 1 && prog_state.iblock != 2 &&
+      prog_state.iblock != 4 && prog_state.iblock != 8) {
+    std::cout << "ERROR: --iblock must be 1, 2, 4 or 8." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (prog_state.jsplit < 0) {
+    std::cout << "ERROR: --jsplit can't be negative." << std::endl;
     exit(EXIT_FAILURE);
   }
 
   // Setup our GLUT window and OpenGL related things.
   // Glut callback functions are setup here too.
-  init_gl(argc, argv);
-
-  // Initialize our MD object, this sets up the context.
-  prog_state.md = new MD();
-
-  // Load and build our CL program from the file.
-  // Presently, this means that you can't run the program from another dir.
-  std::string kernel_source = prog_state.md->loadFile("src/md.cl");
-  prog_state.md->loadProgram(kernel_source, prog_state.group_size);
+  if (!prog_state.headless)
+    init_gl(argc, argv);
+
+  // Unless it shares VBOs with GL, the engine works in its own buffers on
+  // the simulation thread, exactly as when headless.
+  bool offscreen = prog_state.headless || !prog_state.interop;
+  MD *cl_md = NULL;
+  std::string kernel_source;
+  if (prog_state.engine == "cpu") {
+    prog_state.md = new CPUMD(offscreen, prog_state.threads);
+  } else if (prog_state.engine == "cl") {
+    // Initialize our MD object, this sets up the context.
+    cl_md = new MD(offscreen);
+    cl_md->program_cache = prog_state.program_cache;
+    cl_md->fast_math = prog_state.fast_math;
+    cl_md->iblock = prog_state.iblock;
+    cl_md->jsplit = prog_state.jsplit;
+
+    // Load our CL program from the file. It is built once the particle
+    // count is known.
+    // Presently, this means that you can't run the program from another dir.
+    kernel_source = cl_md->loadFile("src/md.cl");
+    prog_state.md = cl_md;
+  } else {
+    std::cout << "ERROR: Unknown engine " << prog_state.engine << std::endl;
+    exit(EXIT_FAILURE);
+  }
 
   // Initialize the particle system with positions, velocities and color.
+  // A loaded configuration is taken over as it is, random values only fill
+  // in what it lacks. A checkpoint replaces them all below.
   int num = prog_state.nparticles;
-  std::vector<cl_float4> pos(num);
-  std::vector<cl_float4> force(num);
-  std::vector<cl_float4> vel(num);
-  std::vector<cl_float4> color(num);
-
-  // Fill the vectors with initial data.
-  for(int i = 0; i < num; i++) {
-    // Distribute the particles in a random cube +- bbox in all directions.
+  std::vector<cl_float4> pos, vel;
+  pos.swap(input_pos);
+  vel.swap(input_vel);
+  bool random_pos = pos.empty() && prog_state.restart.empty();
+  bool random_vel = vel.empty() && prog_state.restart.empty();
+  pos.resize(num);
+  vel.resize(num);
+  std::vector<cl_float4> force(num, f4(0.f, 0.f, 0.f, 0.f));
+  // Just make them red and full alpha now. The kernel will reassign colors.
+  std::vector<cl_float4> color(num, f4(1.0f, 0.0f, 0.0f, 1.0f));
+
+  for (int i = 0; i < num && (random_pos || random_vel); i++) {
     float max = prog_state.bbox;
     float min = -1.f * max;
-    float x = rand_float(min, max);
-    float z = rand_float(min, max);
-    float y = rand_float(min, max);
-    pos[i] = f4(x, y, z, 1.f);
-
-    // Give some initial velocity. Otherwise, things are boring initially.
-    max /= 10;
-    min /= 10;
-    x = rand_float(min, max);
-    z = rand_float(min, max);
-    y = rand_float(min, max);
-    vel[i] = f4(x, y, z, 0.f);
+    float x, y, z;
+    if (random_pos) {
+      // Distribute the particles in a random cube +- bbox in all directions.
+      x = rand_float(min, max);
+      z = rand_float(min, max);
+      y = rand_float(min, max);
+      pos[i] = f4(x, y, z, 1.f);
+    }
 
-    force[i] = f4(0.f, 0.f, 0.f, 0.f);
+    if (random_vel) {
+      // Give some initial velocity. Otherwise, things are boring initially.
+      max /= 10;
+      min /= 10;
+      x = rand_float(min, max);
+      z = rand_float(min, max);
+      y = rand_float(min, max);
+      vel[i] = f4(x, y, z, 0.f);
+    }
+  }
 
-    // Just make them red and full alpha now. The kernel will reassign colors.
-    color[i] = f4(1.0f, 0.0f, 0.0f, 1.0f);
+  if (!prog_state.restart.empty()) {
+    const engine_state &s = restart.state;
+    if (s.pos.size() != (size_t)num) {
+      std::cout << "ERROR: Checkpoint particle count mismatch." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    float bound = prog_state.bbox;
+    for (int i = 0; i < num; i++) {
+      pos[i] = s.pos[i];
+      vel[i] = s.vel[i];
+      force[i] = s.force[i];
+      // Colored by position, as the kernels do.
+      color[i] = f4(std::min(std::max((pos[i].s[0] + bound) / (2 * bound),
+                                      0.2f), 1.f),
+                    std::min(std::max((pos[i].s[1] + bound) / (2 * bound),
+                                      0.2f), 1.f),
+                    std::min(std::max((pos[i].s[2] + bound) / (2 * bound),
+                                      0.2f), 1.f),
+                    1.f);
+    }
   }
 
-  // Move this data to the CL device.
+  // Move this data to the CL device. Keep our copy for the render VBOs.
   prog_state.md->loadData(pos, force, vel, color);
 
   // Set up the kernel functions.
-  prog_state.md->clInit(prog_state.bbox, prog_state.dt,
-                        prog_state.force_kernel_name);
+  sim_params &params = prog_state.params;
+  params.bound = prog_state.bbox;
+  params.dt = prog_state.dt;
+  params.skin = prog_state.skin;
+  params.force_kernel_name = prog_state.force_kernel_name;
+  if (cl_md)
+    cl_md->loadProgram(kernel_source, prog_state.group_size, params);
+  if (prog_state.autotune) {
+    cl_md->autotune(params, &params.force_kernel_name,
+                    &prog_state.group_size);
+    prog_state.force_kernel_name = params.force_kernel_name;
+  }
+  prog_state.md->init(params);
+
+  if (!prog_state.restart.empty()) {
+    prog_state.md->restoreState(restart.state);
+    prog_state.step = restart.state.step;
+  }
+  if (!prog_state.checkpoint.empty())
+    prog_state.checkpoint_writer =
+      new CheckpointWriter(prog_state.checkpoint);
+
+  if (!prog_state.traj.empty()) {
+    // A restart continues the trajectory of the run it came from.
+    int resume_step = prog_state.restart.empty() ? -1 : restart.state.step;
+    prog_state.traj_writer = new TrajectoryWriter(prog_state.traj, num,
+                                                  prog_state.traj_velocities,
+                                                  params.bound, params.dt,
+                                                  params.pbc,
+                                                  prog_state.traj_precision,
+                                                  resume_step);
+    prog_state.md->setTrajectory(prog_state.traj_writer,
+                                 prog_state.traj_every);
+  }
+
+  if (prog_state.validate && !cl_md) {
+    std::cout << "ERROR: --validate needs the cl engine." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  if (prog_state.steps_per_frame > 0)
+    prog_state.batch = prog_state.steps_per_frame;
+
+  if (prog_state.headless) {
+    run_headless();
+    finish_output();
+    return EXIT_SUCCESS;
+  }
+
+  if (prog_state.validate)
+    cl_md->validate();
+
+  if (prog_state.interop) {
+    prog_state.pos_vbo = prog_state.md->pos_vbo;
+    prog_state.col_vbo = prog_state.md->col_vbo;
+  } else {
+    // The renderer owns the VBOs and refreshes them from the snapshots.
+    size_t array_size = num * sizeof(cl_float4);
+    prog_state.pos_vbo = createVBO(&pos[0], array_size, GL_ARRAY_BUFFER,
+                                   GL_DYNAMIC_DRAW);
+    prog_state.col_vbo = createVBO(&color[0], array_size, GL_ARRAY_BUFFER,
+                                   GL_DYNAMIC_DRAW);
+    prog_state.snapshot = new Snapshot(num);
+    prog_state.sim_running = true;
+    CHECK(pthread_create(&prog_state.sim_thread, NULL, sim_loop, NULL), 0);
+  }
 
   CHECK(sem_init(&lock, 0, 1), 0);
 
@@ -231,10 +747,323 @@ int main(int argc, char** argv) {
 }
 
 
+void run_headless() {
+  // Step as fast as the device allows and report the rate at the end.
+  if (prog_state.warmup > 0) {
+    printf("Running %d warm-up steps.\n", prog_state.warmup);
+    for (int i = 0; i < prog_state.warmup; )
+      i += run_batch(prog_state.warmup - i);
+  }
+  // After the warm-up the particles have usually separated, so the forces
+  // are more representative than in the random start.
+  if (prog_state.validate)
+    static_cast<MD *>(prog_state.md)->validate();
+
+  double ke, pe, e0 = 0;
+  if (prog_state.energy) {
+    e0 = total_energy(&ke, &pe);
+    printf("Energy: kinetic %e J, potential %e J, total %e J\n", ke, pe, e0);
+  }
+
+  printf("Running %d steps headless.\n", prog_state.steps);
+  double start = CycleTimer::currentSeconds();
+  double tlast = start;
+  for (int i = 0; i < prog_state.steps; ) {
+    i += run_batch(prog_state.steps - i);
+    // Log the phase timings about once a second.
+    double tnow = CycleTimer::currentSeconds();
+    if (tnow > tlast + 1.f) {
+      std::cout << "Step " << i << " (" << prog_state.batch << "/batch): "
+                << step_stats() << std::endl;
+      tlast = tnow;
+    }
+  }
+  double elapsed = CycleTimer::currentSeconds() - start;
+
+  double ms_per_step = 1000 * elapsed / prog_state.steps;
+  double steps_per_s = prog_state.steps / elapsed;
+  // All-pairs equivalent, N(N-1) per step whatever the kernel evaluates, so
+  // kernels with a cutoff can be compared directly. Not the pairs actually
+  // computed.
+  double n = prog_state.nparticles;
+  double allpairs_per_s = n * (n - 1) * steps_per_s;
+  printf("Steps: %d, time: %f s, ms/step: %f, steps/s: %f, "
+         "all-pairs equiv/s: %e\n", prog_state.steps, elapsed, ms_per_step,
+         steps_per_s, allpairs_per_s);
+  std::cout << step_stats() << std::endl;
+
+  if (prog_state.energy) {
+    double e1 = total_energy(&ke, &pe);
+    // Relative change over the run, and per simulated nanosecond.
+    double drift = (e1 - e0) / fabs(e0);
+    double ns = prog_state.steps * prog_state.dt * 1e9;
+    printf("Energy: kinetic %e J, potential %e J, total %e J\n", ke, pe, e1);
+    printf("Energy drift: %e relative, %e per ns (%s, dt %g)\n", drift,
+           drift / ns, prog_state.params.integrator.c_str(), prog_state.dt);
+    if (!prog_state.params.pbc && prog_state.params.elasticity != 1.f)
+      printf("Note: wall bounces with --elasticity %g lose energy.\n",
+             prog_state.params.elasticity);
+  }
+
+  if (!prog_state.report.empty()) {
+    FILE *f = fopen(prog_state.report.c_str(), "a");
+    if (!f) {
+      perror(prog_state.report.c_str());
+      exit(EXIT_FAILURE);
+    }
+    // Write the header if the file is new.
+    fseek(f, 0, SEEK_END);
+    if (ftell(f) == 0)
+      fprintf(f, "engine,kernel,nparticles,bbox,group_size,dt,seed,warmup,"
+              "steps_per_frame,steps,seconds,ms_per_step,steps_per_s,"
+              "allpairs_equiv_per_s\n");
+    fprintf(f, "%s,%s,%zu,%g,%d,%g,%u,%d,%d,%d,%f,%f,%f,%e\n",
+            prog_state.engine.c_str(), prog_state.force_kernel_name.c_str(),
+            prog_state.nparticles, prog_state.bbox, prog_state.group_size,
+            prog_state.dt, prog_state.seed, prog_state.warmup,
+            prog_state.steps_per_frame, prog_state.steps, elapsed,
+            ms_per_step, steps_per_s, allpairs_per_s);
+    fclose(f);
+  }
+}
+
+
+int run_batch(int max_steps) {
+  // Run up to one batch of steps and, if adaptive, resize the next batch so
+  // it takes about BATCH_MS.
+  int n = std::min(prog_state.batch, max_steps);
+  int every = prog_state.checkpoint_every;
+  bool checkpoints = prog_state.checkpoint_writer && every > 0;
+  if (checkpoints)
+    // End the batch on the next checkpoint.
+    n = std::min(n, every - prog_state.step % every);
+  double start = CycleTimer::currentSeconds();
+  prog_state.md->runKernel(n);
+  double ms = 1000 * (CycleTimer::currentSeconds() - start);
+  prog_state.step += n;
+  if (checkpoints && prog_state.step % every == 0)
+    write_checkpoint();
+
+  // Observables sampled during the batch. Headless runs log every one.
+  std::vector<observables> samples;
+  prog_state.md->takeObservables(&samples);
+  for (size_t i = 0; i < samples.size(); i++) {
+    const observables &o = samples[i];
+    if (prog_state.headless)
+      printf("Observe %d: kinetic %e J, potential %e J, total %e J, "
+             "T %.1f K, P %e Pa\n", o.step, o.kinetic, o.potential,
+             o.kinetic + o.potential, o.temperature, o.pressure);
+  }
+  if (!samples.empty()) {
+    prog_state.obs = samples.back();
+    prog_state.have_obs = true;
+  }
+
+  if (prog_state.steps_per_frame == 0) {
+    int want = (int)(BATCH_MS * n / std::max(ms, 1e-3));
+    // Grow gradually, shrink at once.
+    prog_state.batch = std::max(1, std::min(want, 2 * prog_state.batch));
+  }
+  return n;
+}
+
+
+void *sim_loop(void *arg) {
+  // Step forever, publishing a snapshot after each batch. The renderer picks
+  // up whichever snapshot is newest when it draws.
+  int step = 0;
+  while (prog_state.sim_running) {
+    int n = run_batch(prog_state.batch);
+    step += n;
+    __sync_fetch_and_add(&prog_state.steps_done, n);
+
+    Snapshot::frame &f = prog_state.snapshot->back();
+    prog_state.md->readState(&f.pos[0], &f.col[0]);
+    f.stats = step_stats();
+    f.step = step;
+    prog_state.snapshot->publish();
+  }
+  return NULL;
+}
+
+
+double total_energy(double *kinetic, double *potential) {
+  int num = prog_state.nparticles;
+  std::vector<cl_float4> pos(num), col(num), vel(num);
+  prog_state.md->readState(&pos[0], &col[0]);
+  prog_state.md->readVelocities(&vel[0]);
+  // The all-pairs kernels have no cutoff.
+  std::string base = kernelBaseName(prog_state.force_kernel_name);
+  bool all_pairs = allPairsKernel(base);
+  const sim_params &params = prog_state.params;
+  *kinetic = kineticEnergy(vel, params.mass);
+  *potential = potentialEnergy(pos, params, all_pairs ? 0.f : params.cutoff);
+  return *kinetic + *potential;
+}
+
+
+const std::string &stats() {
+  // The profile belongs to the simulation thread once it runs.
+  static std::string summary;
+  if (prog_state.snapshot)
+    return prog_state.snapshot->front().stats;
+  summary = step_stats();
+  return summary;
+}
+
+
+std::string step_stats() {
+  // Phase timings and the last temperature reading.
+  std::stringstream ss;
+  ss << prog_state.md->profile.summary() << ", T: " << std::fixed
+     << std::setprecision(1) << prog_state.md->temperature() << " K";
+  if (prog_state.have_obs) {
+    const observables &o = prog_state.obs;
+    ss << std::scientific << std::setprecision(3) << ", E: "
+       << o.kinetic + o.potential << " J, P: " << o.pressure << " Pa";
+  }
+  return ss.str();
+}
+
+
+std::string save_settings() {
+  // Everything that shapes the simulation, one "key=value" per line. Floats
+  // get 9 digits so they read back exactly.
+  const sim_params &p = prog_state.params;
+  std::stringstream ss;
+  ss << std::setprecision(9)
+     << "engine=" << prog_state.engine << "\n"
+     << "force_kernel=" << prog_state.force_kernel_name << "\n"
+     << "nparticles=" << prog_state.nparticles << "\n"
+     << "bbox=" << prog_state.bbox << "\n"
+     << "group_size=" << prog_state.group_size << "\n"
+     << "dt=" << prog_state.dt << "\n"
+     << "skin=" << prog_state.skin << "\n"
+     << "fast_math=" << prog_state.fast_math << "\n"
+     << "iblock=" << prog_state.iblock << "\n"
+     << "jsplit=" << prog_state.jsplit << "\n"
+     << "steps_per_frame=" << prog_state.steps_per_frame << "\n"
+     << "seed=" << p.seed << "\n"
+     << "sigma=" << p.sigma << "\n"
+     << "epsilon=" << p.epsilon << "\n"
+     << "cutoff=" << p.cutoff << "\n"
+     << "mass=" << p.mass << "\n"
+     << "elasticity=" << p.elasticity << "\n"
+     << "integrator=" << p.integrator << "\n"
+     << "pbc=" << p.pbc << "\n"
+     << "thermostat=" << p.thermostat << "\n"
+     << "temperature=" << p.temperature << "\n"
+     << "tau=" << p.tau << "\n"
+     << "thermo_every=" << p.thermo_every << "\n"
+     << "observe_every=" << p.observe_every << "\n";
+  return ss.str();
+}
+
+
+void load_settings(const std::string &settings) {
+  sim_params &p = prog_state.params;
+  std::istringstream in(settings);
+  std::string line;
+  while (std::getline(in, line)) {
+    size_t eq = line.find('=');
+    if (eq == std::string::npos)
+      continue;
+    std::string key = line.substr(0, eq);
+    const char *value = line.c_str() + eq + 1;
+    if (key == "engine")
+      prog_state.engine = value;
+    else if (key == "force_kernel")
+      prog_state.force_kernel_name = value;
+    else if (key == "nparticles")
+      prog_state.nparticles = atoi(value);
+    else if (key == "bbox")
+      prog_state.bbox = atof(value);
+    else if (key == "group_size")
+      prog_state.group_size = atoi(value);
+    else if (key == "dt")
+      prog_state.dt = atof(value);
+    else if (key == "skin")
+      prog_state.skin = atof(value);
+    else if (key == "fast_math")
+      prog_state.fast_math = atoi(value);
+    else if (key == "iblock")
+      prog_state.iblock = atoi(value);
+    else if (key == "jsplit")
+      prog_state.jsplit = atoi(value);
+    else if (key == "steps_per_frame")
+      prog_state.steps_per_frame = atoi(value);
+    else if (key == "seed")
+      prog_state.seed = strtoul(value, NULL, 10);
+    else if (key == "sigma")
+      p.sigma = atof(value);
+    else if (key == "epsilon")
+      p.epsilon = atof(value);
+    else if (key == "cutoff")
+      p.cutoff = atof(value);
+    else if (key == "mass")
+      p.mass = atof(value);
+    else if (key == "elasticity")
+      p.elasticity = atof(value);
+    else if (key == "integrator")
+      p.integrator = value;
+    else if (key == "pbc")
+      p.pbc = atoi(value);
+    else if (key == "thermostat")
+      p.thermostat = value;
+    else if (key == "temperature")
+      p.temperature = atof(value);
+    else if (key == "tau")
+      p.tau = atof(value);
+    else if (key == "thermo_every")
+      p.thermo_every = atoi(value);
+    else if (key == "observe_every")
+      p.observe_every = atoi(value);
+    else
+      printf("Ignoring unknown checkpoint setting %s\n", key.c_str());
+  }
+  prog_state.translate_z = -2.2f * prog_state.bbox;
+}
+
+
+void write_checkpoint() {
+  // Copy the state now and let the writer thread put it on disk.
+  checkpoint &ck = prog_state.checkpoint_writer->begin();
+  ck.settings = save_settings();
+  prog_state.md->saveState(&ck.state);
+  prog_state.checkpoint_writer->commit();
+}
+
+
+void finish_output() {
+  // Save where we stopped, then flush the writers.
+  if (prog_state.checkpoint_writer) {
+    int every = prog_state.checkpoint_every;
+    if (every <= 0 || prog_state.step % every != 0)
+      write_checkpoint();
+    delete prog_state.checkpoint_writer;
+  }
+  delete prog_state.traj_writer;
+}
+
+
 void appRender() {
   sem_wait(&lock);
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+  if (prog_state.snapshot) {
+    prog_state.frames++;
+    // Upload the newest complete snapshot, if there is a new one.
+    if (prog_state.snapshot->acquire()) {
+      const Snapshot::frame &f = prog_state.snapshot->front();
+      size_t array_size = f.pos.size() * sizeof(cl_float4);
+      glBindBuffer(GL_ARRAY_BUFFER, prog_state.pos_vbo);
+      glBufferSubData(GL_ARRAY_BUFFER, 0, array_size, &f.pos[0]);
+      glBindBuffer(GL_ARRAY_BUFFER, prog_state.col_vbo);
+      glBufferSubData(GL_ARRAY_BUFFER, 0, array_size, &f.col[0]);
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+  }
+
   // This updates the particle system by calling the kernel.
   //prog_state.md->runKernel();
 
@@ -242,8 +1071,11 @@ void appRender() {
   double tnow = CycleTimer::currentSeconds();// - prog_state.t0;
   if (tnow > prog_state.tlast + 1.f) {
     prog_state.framerate = prog_state.frames;
+    prog_state.steprate = __sync_lock_test_and_set(&prog_state.steps_done, 0) /
+                          (tnow - prog_state.tlast);
     prog_state.perframe = 1000 * (tnow - prog_state.tlast) / prog_state.frames;
     //std::cout << "Frames: " << prog_state.framerate << std::endl;
+    std::cout << stats() << std::endl;
     prog_state.tlast = tnow;
     prog_state.frames = 0;
   }
@@ -255,11 +1087,11 @@ void appRender() {
   glPointSize(5.);
 
   // Color buffer.
-  glBindBuffer(GL_ARRAY_BUFFER, prog_state.md->col_vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, prog_state.col_vbo);
   glColorPointer(4, GL_FLOAT, 0, 0);
 
   // Vertex buffer.
-  glBindBuffer(GL_ARRAY_BUFFER, prog_state.md->pos_vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, prog_state.pos_vbo);
   glVertexPointer(4, GL_FLOAT, 0, 0);
 
   glEnableClientState(GL_VERTEX_ARRAY);
@@ -267,18 +1099,24 @@ void appRender() {
 
   glDisableClientState(GL_NORMAL_ARRAY);
 
-  glDrawArrays(GL_POINTS, 0, prog_state.md->num);
+  glDrawArrays(GL_POINTS, 0, prog_state.nparticles);
 
   glDisableClientState(GL_COLOR_ARRAY);
   glDisableClientState(GL_VERTEX_ARRAY);
 
   // Display framerate.
   std::stringstream fr;
-  fr << "FPS: " << prog_state.framerate << ", ms/F: " << prog_state.perframe;
+  fr << "FPS: " << prog_state.framerate << ", ms/F: " << prog_state.perframe
+     << ", steps/s: " << prog_state.steprate << ", steps/F: "
+     << prog_state.batch;
   glRasterPos3f(-prog_state.bbox, prog_state.bbox, prog_state.bbox);
   glColor4f(0.0f, 0.0f, 1.0f, 1.0f);
   glutBitmapString(GLUT_BITMAP_HELVETICA_18,
                    (const unsigned char*)fr.str().c_str());
+  // Per-phase step timings, below the framerate.
+  glRasterPos3f(-prog_state.bbox, 0.9f * prog_state.bbox, prog_state.bbox);
+  glutBitmapString(GLUT_BITMAP_HELVETICA_12,
+                   (const unsigned char*)stats().c_str());
 
   glutSwapBuffers();
   sem_post(&lock);
@@ -304,8 +1142,11 @@ void init_gl(int argc, char** argv) {
 
   // Set up callbacks.
   glutDisplayFunc(appRender);      // Main rendering function.
-  glutTimerFunc(50, timerCB, 50);  // Determine a minimum time between frames.
-  glutTimerFunc(1, call_kernel, 1);
+  // Determine a minimum time between frames.
+  glutTimerFunc(FRAME_MS, timerCB, FRAME_MS);
+  // Without a simulation thread, step between frames.
+  if (prog_state.interop)
+    glutTimerFunc(1, call_kernel, 1);
   glutKeyboardFunc(appKeyboard);
   glutMouseFunc(appMouse);
   glutMotionFunc(appMotion);
@@ -335,7 +1176,7 @@ void init_gl(int argc, char** argv) {
 
 void call_kernel(int ms) {
   sem_wait(&lock);
-  prog_state.md->runKernel();
+  __sync_fetch_and_add(&prog_state.steps_done, run_batch(prog_state.batch));
   prog_state.frames++;
   sem_post(&lock);
   glutTimerFunc(ms, call_kernel, ms);
@@ -368,6 +1209,12 @@ void appKeyboard(unsigned char key, int x, int y) {
   case 'q':    // q (or escape) quits
     // Cleanup up and quit
     //appDestroy();
+    if (prog_state.snapshot) {
+      // Let the simulation thread finish its batch first.
+      prog_state.sim_running = false;
+      pthread_join(prog_state.sim_thread, NULL);
+    }
+    finish_output();
     exit(0);
     break;
   }
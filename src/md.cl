@@ -1,10 +1,52 @@
 #define ZERO4 ((float4)(0.f, 0.f, 0.f, 0.f))
 
+// The physical constants and system size are normally set by the host with
+// -D when the program is built. These defaults match the command line ones.
+#ifndef SIGMA
+#define SIGMA 4.10f                // Angstrom.
+#endif
+#ifndef EPSILON
+#define EPSILON (1770 / 6.022e23f)  // Joule(/atom).
+#endif
+#ifndef CUTOFF
+#define CUTOFF 10.f                // Angstrom.
+#endif
+#ifndef MASS
+#define MASS 2.18017e-25f          // Kilogram.
+#endif
+#ifndef ELASTICITY
+#define ELASTICITY 0.5f
+#endif
+#ifndef NUM
+#define NUM 1024                   // Number of particles.
+#endif
+#ifndef BOUND
+#define BOUND 50.f                 // Size of the bounding box (+-), Angstrom.
+#endif
+#ifndef DT
+#define DT 1e-15f                  // Time step, seconds.
+#endif
+#ifndef IBLOCK
+#define IBLOCK 4                   // Particles per work-item in force_block.
+#endif
+// With -D PBC the box is periodic: pairs interact through the nearest image
+// and particles leaving one face come back in through the opposite one.
+
+
+// The image of q nearest to p.
+float4 nearest_image(float4 p, float4 q) {
+#ifdef PBC
+  return q - (2 * BOUND) * round((q - p) / (2 * BOUND));
+#else
+  return q;
+#endif
+}
+
 
 float4 lj_force(float4 pos1, float4 pos2, float dist) {
   float4 res;
-  float sigma = 4.10;                 // Angstrom.
-  float epsilon = 1770 / (6.022e23);  // Joule(/atom).
+  float sigma = SIGMA;      // Angstrom.
+  float epsilon = EPSILON;  // Joule(/atom).
 
   if (dist <= 1e-5)
     return ZERO4;   // Don't count yourself.
@@ -21,122 +63,641 @@ float4 lj_force(float4 pos1, float4 pos2, float dist) {
 }
 
 
+// The same force from the squared distance alone: no sqrt, no pow and a
+// single division. d = pos1 - pos2 and r2 = |d|^2. Used with -D LJ_FAST.
+float4 lj_force_r2(float4 d, float r2) {
+  if (r2 <= 1e-10f)
+    return ZERO4;   // Don't count yourself.
+  r2 = max(r2, 0.01f);  // Particles can never be on top of each other!
+  float inv2 = 1.f / r2;
+  float s2 = SIGMA * SIGMA * inv2;
+  float s6 = s2 * s2 * s2;
+  // lj_force divides by dist twice, once for the force and once to
+  // normalize d, which together is inv2.
+  return (24 * EPSILON / 1e-10f) * (2 * s6 * s6 - s6) * inv2 * d;  // Newton.
+}
+
+
+// With -D OBSERVE the force kernels also store each particle's share of the
+// potential energy (Joule) and of the virial sum of d.F (Newton * Angstrom)
+// in an extra observe argument (force_split_sum's for the split kernels).
+// Otherwise the obs accumulators are unused and compiled away.
+#ifdef OBSERVE
+#define OBSERVE_ARG , __global float2* observe
+#define OBSERVE_STORE(i, obs) observe[i] = (obs)
+#else
+#define OBSERVE_ARG
+#define OBSERVE_STORE(i, obs)
+#endif
+
+
+// Pair potential 4 epsilon ((sigma/r)^12 - (sigma/r)^6), Joule, with the
+// same clamps as the forces.
+float lj_energy_r2(float r2) {
+  if (r2 <= 1e-10f)
+    return 0.f;
+  float s2 = SIGMA * SIGMA / max(r2, 0.01f);
+  float s6 = s2 * s2 * s2;
+  return 4 * EPSILON * (s6 * s6 - s6);
+}
+
+
+// Add half the energy and virial of the pair with displacement d and force
+// f, less shift, to obs. The other half goes to the other particle.
+void observe_pair(float2* obs, float4 d, float4 f, float shift) {
+#ifdef OBSERVE
+  float r2 = dot(d, d);
+  if (r2 <= 1e-10f)
+    return;
+  obs->x += 0.5f * (lj_energy_r2(r2) - shift);
+  obs->y += 0.5f * dot(d, f);
+#endif
+}
+
+
+// Force on a particle at p from one at q, ignoring pairs beyond the cutoff
+// in the _clip form. Every force kernel goes through these. The clipped
+// potential is shifted to zero at the cutoff, as in energy.cpp.
+#ifdef LJ_FAST
+float4 lj_pair(float4 p, float4 q, float2* obs) {
+  float4 d = p - nearest_image(p, q);
+  float4 f = lj_force_r2(d, dot(d, d));
+  observe_pair(obs, d, f, 0.f);
+  return f;
+}
+
+
+float4 lj_pair_clip(float4 p, float4 q, float2* obs) {
+  float4 d = p - nearest_image(p, q);
+  float r2 = dot(d, d);
+  if (r2 < CUTOFF * CUTOFF) {
+    float4 f = lj_force_r2(d, r2);
+    observe_pair(obs, d, f, lj_energy_r2(CUTOFF * CUTOFF));
+    return f;
+  }
+  return ZERO4;
+}
+#else
+float4 lj_pair(float4 p, float4 q, float2* obs) {
+  q = nearest_image(p, q);
+  float4 f = lj_force(p, q, distance(p, q));
+  observe_pair(obs, p - q, f, 0.f);
+  return f;
+}
+
+
+float4 lj_pair_clip(float4 p, float4 q, float2* obs) {
+  q = nearest_image(p, q);
+  float dist = distance(p, q);
+  if (dist < CUTOFF) {
+    float4 f = lj_force(p, q, dist);
+    observe_pair(obs, p - q, f, lj_energy_r2(CUTOFF * CUTOFF));
+    return f;
+  }
+  return ZERO4;
+}
+#endif
+
+
 __kernel void force_naive(__global float4* pos, __global float4* color,
-                          __global float4* force, int num) {
+                          __global float4* force OBSERVE_ARG) {
   // Get our index in the array.
   size_t idx = get_global_id(0);
+  // The global size is rounded up to a whole number of groups.
+  if (idx >= NUM)
+    return;
   // Copy position for this iteration to a local variable.
   float4 p = pos[idx];
   float4 f = ZERO4;
+  float2 obs = (float2)(0.f, 0.f);
 
-  for (int i = 0; i < num; i++) {
+  for (int i = 0; i < NUM; i++) {
     if (i != idx)
-      f += lj_force(p, pos[i], distance(p, pos[i]));
+      f += lj_pair(p, pos[i], &obs);
   }
 
   force[idx] = f;
+  OBSERVE_STORE(idx, obs);
 }
 
 
 __kernel void force_naive_clip(__global float4* pos, __global float4* color,
-                               __global float4* force, int num) {
+                               __global float4* force OBSERVE_ARG) {
   // Get our index in the array.
   size_t idx = get_global_id(0);
+  if (idx >= NUM)
+    return;
   // Copy position for this iteration to a local variable.
   float4 p = pos[idx];
   float4 f = ZERO4;
-  float cutoff = 10.f;  // Angstrom.
-  float dist;
-
-  for (int i = 0; i < num; i++) {
-    if (i != idx) {
-      dist = distance(p, pos[i]);
-      if (dist < cutoff)
-        f += lj_force(p, pos[i], dist);
-    }
+  float2 obs = (float2)(0.f, 0.f);
+
+  for (int i = 0; i < NUM; i++) {
+    if (i != idx)
+      f += lj_pair_clip(p, pos[i], &obs);
   }
 
   force[idx] = f;
+  OBSERVE_STORE(idx, obs);
 }
 
 
+// The tiled kernels stage one group's worth of positions at a time in
+// workspace, which the host sizes to the group size, so any group size runs
+// from the same build.
 __kernel void force_tile(__global float4* pos, __global float4* color,
-                         __global float4* force, int num) {
+                         __global float4* force,
+                         __local float4* workspace OBSERVE_ARG) {
   // Get our index in the array.
   size_t ix = get_group_id(0);
   size_t lx = get_local_id(0);
   size_t l_dim = get_local_size(0);
   size_t idx = ix * l_dim + lx;
+  // Work-items past the end still take part in loading the tiles.
+  bool active = idx < NUM;
   // Copy position for this iteration to a local variable.
-  float4 p = pos[idx];
+  float4 p = pos[active ? idx : 0];
   float4 f = ZERO4;
+  float2 obs = (float2)(0.f, 0.f);
 
-  __local float4 workspace[SIZE];
-
-  int tile = 0;
-  for (int i = 0; i < num; i+=SIZE) {
-    int id = tile * l_dim + lx;
-    workspace[lx] = pos[id];
+  for (int i = 0; i < NUM; i += l_dim) {
+    if (i + lx < NUM)
+      workspace[lx] = pos[i + lx];
     barrier(CLK_LOCAL_MEM_FENCE);
-    for (int j = 0; j < l_dim; j++) {
-      f += lj_force(p, workspace[j], distance(p, workspace[j]));
+    // The last tile may be partly filled.
+    int n = min((int)l_dim, NUM - i);
+    for (int j = 0; j < n; j++) {
+      f += lj_pair(p, workspace[j], &obs);
     }
     barrier(CLK_LOCAL_MEM_FENCE);
-    tile++;
   }
 
-  force[idx] = f;
+  if (active) {
+    force[idx] = f;
+    OBSERVE_STORE(idx, obs);
+  }
 }
 
 
 __kernel void force_tile_clip(__global float4* pos, __global float4* color,
-                         __global float4* force, int num) {
+                              __global float4* force,
+                              __local float4* workspace OBSERVE_ARG) {
   // Get our index in the array.
   size_t ix = get_group_id(0);
   size_t lx = get_local_id(0);
   size_t l_dim = get_local_size(0);
   size_t idx = ix * l_dim + lx;
+  // Work-items past the end still take part in loading the tiles.
+  bool active = idx < NUM;
   // Copy position for this iteration to a local variable.
-  float4 p = pos[idx];
+  float4 p = pos[active ? idx : 0];
   float4 f = ZERO4;
-  float cutoff = 10.f;  // Angstrom.
-  float dist;
+  float2 obs = (float2)(0.f, 0.f);
+
+  for (int i = 0; i < NUM; i += l_dim) {
+    if (i + lx < NUM)
+      workspace[lx] = pos[i + lx];
+    barrier(CLK_LOCAL_MEM_FENCE);
+    // The last tile may be partly filled.
+    int n = min((int)l_dim, NUM - i);
+    for (int j = 0; j < n; j++) {
+      f += lj_pair_clip(p, workspace[j], &obs);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (active) {
+    force[idx] = f;
+    OBSERVE_STORE(idx, obs);
+  }
+}
+
 
-  __local float4 workspace[SIZE];
+// Each work-item of the blocked kernels keeps IBLOCK particles in registers,
+// group_size apart, so a group covers IBLOCK * group_size particles and every
+// position read from local memory is used IBLOCK times. workspace holds two
+// tiles: the next one is copied in with async_work_group_copy while the
+// current one is in use.
+__kernel void force_block(__global float4* pos, __global float4* color,
+                          __global float4* force,
+                          __local float4* workspace OBSERVE_ARG) {
+  size_t lx = get_local_id(0);
+  int l_dim = get_local_size(0);
+  size_t base = get_group_id(0) * l_dim * IBLOCK + lx;
+  float4 p[IBLOCK], f[IBLOCK];
+  float2 obs[IBLOCK];
+  for (int k = 0; k < IBLOCK; k++) {
+    // Work-items past the end compute throwaway forces for the last one.
+    p[k] = pos[min(base + k * l_dim, (size_t)NUM - 1)];
+    f[k] = ZERO4;
+    obs[k] = (float2)(0.f, 0.f);
+  }
 
-  int tile = 0;
-  for (int i = 0; i < num; i+=SIZE) {
-    int id = tile * l_dim + lx;
-    workspace[lx] = pos[id];
+  __local float4* tile = workspace;
+  __local float4* next = workspace + l_dim;
+  event_t copied = async_work_group_copy(tile, pos, min(l_dim, NUM), 0);
+  for (int i = 0; i < NUM; i += l_dim) {
+    wait_group_events(1, &copied);
+    // Everyone is done with next, it was last iteration's tile.
+    if (i + l_dim < NUM)
+      copied = async_work_group_copy(next, pos + i + l_dim,
+                                     min(l_dim, NUM - i - l_dim), 0);
+    // The last tile may be partly filled.
+    int n = min(l_dim, NUM - i);
+    for (int j = 0; j < n; j++) {
+      float4 q = tile[j];
+      for (int k = 0; k < IBLOCK; k++)
+        f[k] += lj_pair(p[k], q, &obs[k]);
+    }
     barrier(CLK_LOCAL_MEM_FENCE);
-    for (int j = 0; j < l_dim; j++) {
-      dist = distance(p, workspace[j]);
-      if (dist < cutoff)
-        f += lj_force(p, workspace[j], dist);
+    __local float4* t = tile;
+    tile = next;
+    next = t;
+  }
+
+  for (int k = 0; k < IBLOCK; k++) {
+    size_t idx = base + k * l_dim;
+    if (idx < NUM) {
+      force[idx] = f[k];
+      OBSERVE_STORE(idx, obs[k]);
+    }
+  }
+}
+
+
+__kernel void force_block_clip(__global float4* pos, __global float4* color,
+                               __global float4* force,
+                               __local float4* workspace OBSERVE_ARG) {
+  size_t lx = get_local_id(0);
+  int l_dim = get_local_size(0);
+  size_t base = get_group_id(0) * l_dim * IBLOCK + lx;
+  float4 p[IBLOCK], f[IBLOCK];
+  float2 obs[IBLOCK];
+  for (int k = 0; k < IBLOCK; k++) {
+    // Work-items past the end compute throwaway forces for the last one.
+    p[k] = pos[min(base + k * l_dim, (size_t)NUM - 1)];
+    f[k] = ZERO4;
+    obs[k] = (float2)(0.f, 0.f);
+  }
+
+  __local float4* tile = workspace;
+  __local float4* next = workspace + l_dim;
+  event_t copied = async_work_group_copy(tile, pos, min(l_dim, NUM), 0);
+  for (int i = 0; i < NUM; i += l_dim) {
+    wait_group_events(1, &copied);
+    // Everyone is done with next, it was last iteration's tile.
+    if (i + l_dim < NUM)
+      copied = async_work_group_copy(next, pos + i + l_dim,
+                                     min(l_dim, NUM - i - l_dim), 0);
+    // The last tile may be partly filled.
+    int n = min(l_dim, NUM - i);
+    for (int j = 0; j < n; j++) {
+      float4 q = tile[j];
+      for (int k = 0; k < IBLOCK; k++)
+        f[k] += lj_pair_clip(p[k], q, &obs[k]);
     }
     barrier(CLK_LOCAL_MEM_FENCE);
-    tile++;
+    __local float4* t = tile;
+    tile = next;
+    next = t;
   }
 
+  for (int k = 0; k < IBLOCK; k++) {
+    size_t idx = base + k * l_dim;
+    if (idx < NUM) {
+      force[idx] = f[k];
+      OBSERVE_STORE(idx, obs[k]);
+    }
+  }
+}
+
+
+// Small systems leave most of a large device idle with one work-item per
+// particle, so the split kernels run over a 2D range instead: work-item
+// (i, s) adds up the forces on particle i from the s-th of
+// get_global_size(1) slices of the particles into partial[s * NUM + i], and
+// force_split_sum adds up the slices. With OBSERVE the energies and virials
+// of slice s follow in partial[(nsplit + s) * NUM + i].
+__kernel void force_split(__global float4* pos, __global float4* color,
+                          __global float4* partial) {
+  // Get our index in the array.
+  size_t idx = get_global_id(0);
+  if (idx >= NUM)
+    return;
+  int s = get_global_id(1);
+  int nsplit = get_global_size(1);
+  int slice = (NUM + nsplit - 1) / nsplit;
+  int end = min((s + 1) * slice, NUM);
+  // Copy position for this iteration to a local variable.
+  float4 p = pos[idx];
+  float4 f = ZERO4;
+  float2 obs = (float2)(0.f, 0.f);
+
+  for (int i = s * slice; i < end; i++) {
+    if (i != idx)
+      f += lj_pair(p, pos[i], &obs);
+  }
+
+  partial[s * NUM + idx] = f;
+#ifdef OBSERVE
+  partial[(nsplit + s) * NUM + idx] = (float4)(obs, 0.f, 0.f);
+#endif
+}
+
+
+__kernel void force_split_clip(__global float4* pos, __global float4* color,
+                               __global float4* partial) {
+  // Get our index in the array.
+  size_t idx = get_global_id(0);
+  if (idx >= NUM)
+    return;
+  int s = get_global_id(1);
+  int nsplit = get_global_size(1);
+  int slice = (NUM + nsplit - 1) / nsplit;
+  int end = min((s + 1) * slice, NUM);
+  // Copy position for this iteration to a local variable.
+  float4 p = pos[idx];
+  float4 f = ZERO4;
+  float2 obs = (float2)(0.f, 0.f);
+
+  for (int i = s * slice; i < end; i++) {
+    if (i != idx)
+      f += lj_pair_clip(p, pos[i], &obs);
+  }
+
+  partial[s * NUM + idx] = f;
+#ifdef OBSERVE
+  partial[(nsplit + s) * NUM + idx] = (float4)(obs, 0.f, 0.f);
+#endif
+}
+
+
+__kernel void force_split_sum(__global float4* partial, __global float4* force,
+                              int nsplit OBSERVE_ARG) {
+  // Get our index in the array.
+  size_t idx = get_global_id(0);
+  if (idx >= NUM)
+    return;
+  float4 f = ZERO4;
+  float2 obs = (float2)(0.f, 0.f);
+  for (int s = 0; s < nsplit; s++)
+    f += partial[s * NUM + idx];
+#ifdef OBSERVE
+  for (int s = 0; s < nsplit; s++)
+    obs += partial[(nsplit + s) * NUM + idx].xy;
+#endif
+
   force[idx] = f;
+  OBSERVE_STORE(idx, obs);
 }
 
 
-__kernel void update(__global float4* pos, __global float4* color,
-                     __global float4* force, __global float4* vel,
-                     float bound, float dt) {
+// Find the grid cell containing a position. Particles are kept inside +-BOUND
+// by update, so anything on the upper face is folded into the last cell.
+int4 cell_coord(float4 p, float cell_size, int4 dims) {
+  int4 c = convert_int4((p + BOUND) / cell_size);
+  return clamp(c, (int4)(0), dims - 1);
+}
+
+
+int cell_index(int4 c, int4 dims) {
+  return (c.z * dims.y + c.y) * dims.x + c.x;
+}
+
+
+// Index of the cell at offset d from cell c, or -1 past a wall. With PBC
+// the grid wraps around; the host makes sure it is at least 3 cells wide so
+// no cell is visited twice.
+int neighbor_cell(int4 c, int4 d, int4 dims) {
+  int4 n = c + d;
+#ifdef PBC
+  n = (n + dims) % dims;
+#else
+  if (n.x < 0 || n.y < 0 || n.z < 0 ||
+      n.x >= dims.x || n.y >= dims.y || n.z >= dims.z)
+    return -1;
+#endif
+  return cell_index(n, dims);
+}
+
+
+// The binning kernels only run when rebuild[0] is set. force_cell leaves it
+// set permanently, the neighbor list kernels only set it when needed.
+__kernel void cell_clear(__global int* cell_count, __global int* rebuild) {
+  if (!rebuild[0])
+    return;
+  cell_count[get_global_id(0)] = 0;
+}
+
+
+// cell_count keeps counting past cell_cap, so a full cell can be told from
+// one that fits. overflow[0] records the largest count that did not fit, for
+// the host to grow the cells.
+__kernel void cell_bin(__global float4* pos, __global int* cells,
+                       __global int* cell_count, float cell_size, int4 dims,
+                       int cell_cap, __global int* rebuild,
+                       __global int* overflow) {
+  if (!rebuild[0])
+    return;
   // Get our index in the array.
-  size_t i = get_global_id(0);
-  // Copy position, velocity, and force for this iteration to a local variable.
-  float4 p = pos[i];             // Angstrom.
-  float4 f = force[i];           // Newton = Kilogram * Meter/Second^2.
-  float4 a = f / (2.18017e-25);  // Meter/Second^2.
-  float4 v = vel[i];             // Meter/S.
-  v += a * dt;
-  p += v * dt * 1e10;
+  size_t idx = get_global_id(0);
+  int c = cell_index(cell_coord(pos[idx], cell_size, dims), dims);
+
+  // Claim a slot in our cell.
+  int slot = atomic_inc(&cell_count[c]);
+  if (slot < cell_cap)
+    cells[c * cell_cap + slot] = idx;
+  else
+    atomic_max(&overflow[0], slot + 1);
+}
 
+
+// Whether any of the 27 cells around c has particles that did not fit. The
+// neighbor scans from c would miss them.
+bool cells_full(int4 c, int4 dims, __global int* cell_count, int cell_cap) {
+  for (int dz = -1; dz <= 1; dz++) {
+    for (int dy = -1; dy <= 1; dy++) {
+      for (int dx = -1; dx <= 1; dx++) {
+        int cell = neighbor_cell(c, (int4)(dx, dy, dz, 0), dims);
+        if (cell >= 0 && cell_count[cell] > cell_cap)
+          return true;
+      }
+    }
+  }
+  return false;
+}
+
+
+// The clipped force on particle idx at p from all others, for the particles
+// whose neighbor structures overflowed until the host has grown them.
+float4 clip_all(__global float4* pos, size_t idx, float4 p, float2* obs) {
+  float4 f = ZERO4;
+  for (int i = 0; i < NUM; i++) {
+    if (i != idx)
+      f += lj_pair_clip(p, pos[i], obs);
+  }
+  return f;
+}
+
+
+__kernel void force_cell(__global float4* pos, __global float4* color,
+                         __global float4* force,
+                         __global int* cells, __global int* cell_count,
+                         float cell_size, int4 dims, int cell_cap
+                         OBSERVE_ARG) {
+  // Get our index in the array.
+  size_t idx = get_global_id(0);
+  if (idx >= NUM)
+    return;
+  // Copy position for this iteration to a local variable.
+  float4 p = pos[idx];
+  float4 f = ZERO4;
+  float2 obs = (float2)(0.f, 0.f);
+
+  // The cell edge is at least the cutoff, so every interacting particle is
+  // in one of the 27 cells around our own.
+  int4 c = cell_coord(p, cell_size, dims);
+  if (cells_full(c, dims, cell_count, cell_cap)) {
+    force[idx] = clip_all(pos, idx, p, &obs);
+    OBSERVE_STORE(idx, obs);
+    return;
+  }
+  for (int dz = -1; dz <= 1; dz++) {
+    for (int dy = -1; dy <= 1; dy++) {
+      for (int dx = -1; dx <= 1; dx++) {
+        int cell = neighbor_cell(c, (int4)(dx, dy, dz, 0), dims);
+        if (cell < 0)
+          continue;
+        int count = cell_count[cell];
+        __global int* members = cells + cell * cell_cap;
+        for (int k = 0; k < count; k++) {
+          int j = members[k];
+          if (j != idx)
+            f += lj_pair_clip(p, pos[j], &obs);
+        }
+      }
+    }
+  }
+
+  force[idx] = f;
+  OBSERVE_STORE(idx, obs);
+}
+
+
+// Flag a rebuild if any particle has moved more than half the skin since the
+// neighbor list was built. Two particles can then have closed the gap by at
+// most a full skin, so the list still holds every pair inside the cutoff.
+__kernel void nlist_check(__global float4* pos, __global float4* pos_ref,
+                          __global int* rebuild, float half_skin) {
+  // Get our index in the array.
+  size_t idx = get_global_id(0);
+  float4 d = pos[idx] - nearest_image(pos[idx], pos_ref[idx]);
+  d.w = 0.f;
+  if (dot(d, d) > half_skin * half_skin)
+    rebuild[0] = 1;
+}
+
+
+__kernel void nlist_build(__global float4* pos, __global float4* pos_ref,
+                          __global int* neighbors,
+                          __global int* neighbor_count,
+                          __global int* cells, __global int* cell_count,
+                          float cell_size, int4 dims, int cell_cap,
+                          float radius, int nlist_cap,
+                          __global int* rebuild, __global int* overflow) {
+  if (!rebuild[0])
+    return;
+  // Get our index in the array.
+  size_t idx = get_global_id(0);
+  float4 p = pos[idx];
+  int count = 0;
+
+  int4 c = cell_coord(p, cell_size, dims);
+  if (cells_full(c, dims, cell_count, cell_cap)) {
+    // Some of the candidates did not fit in the grid, so try everyone.
+    for (int j = 0; j < NUM; j++) {
+      if (j != idx && distance(p, nearest_image(p, pos[j])) < radius) {
+        if (count < nlist_cap)
+          neighbors[count * NUM + idx] = j;
+        count++;
+      }
+    }
+  } else {
+    for (int dz = -1; dz <= 1; dz++) {
+      for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+          int cell = neighbor_cell(c, (int4)(dx, dy, dz, 0), dims);
+          if (cell < 0)
+            continue;
+          int members = cell_count[cell];
+          for (int k = 0; k < members; k++) {
+            int j = cells[cell * cell_cap + k];
+            if (j != idx && distance(p, nearest_image(p, pos[j])) < radius) {
+              // Stored column-major so neighboring work-items read
+              // neighboring addresses in force_nlist.
+              if (count < nlist_cap)
+                neighbors[count * NUM + idx] = j;
+              count++;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // A list that did not fit is marked -1, and overflow[1] records the
+  // longest such list for the host to grow them.
+  if (count > nlist_cap) {
+    atomic_max(&overflow[1], count);
+    count = -1;
+  }
+  neighbor_count[idx] = count;
+  pos_ref[idx] = p;
+}
+
+
+__kernel void nlist_reset(__global int* rebuild) {
+  rebuild[0] = 0;
+}
+
+
+__kernel void force_nlist(__global float4* pos, __global float4* color,
+                          __global float4* force,
+                          __global int* neighbors,
+                          __global int* neighbor_count OBSERVE_ARG) {
+  // Get our index in the array.
+  size_t idx = get_global_id(0);
+  if (idx >= NUM)
+    return;
+  // Copy position for this iteration to a local variable.
+  float4 p = pos[idx];
+  float4 f = ZERO4;
+  float2 obs = (float2)(0.f, 0.f);
+
+  int count = neighbor_count[idx];
+  if (count < 0)
+    f = clip_all(pos, idx, p, &obs);
+  for (int k = 0; k < count; k++) {
+    f += lj_pair_clip(p, pos[neighbors[k * NUM + idx]], &obs);
+  }
+
+  force[idx] = f;
+  OBSERVE_STORE(idx, obs);
+}
+
+
+// Move a particle by v * dt, bouncing it off the walls (or wrapping it
+// around with PBC), and store its new position, velocity and color.
+void drift_to(__global float4* pos, __global float4* color,
+              __global float4* vel, size_t i, float4 p, float4 v) {
+  p += v * DT * 1e10f;
+  float bound = BOUND;
+
+#ifdef PBC
+  p.xyz -= (2 * bound) * floor((p.xyz + bound) / (2 * bound));
+#else
   // Handle collisions with walls.
-  float elasticity = 0.5;
+  float elasticity = ELASTICITY;
   if (p.x >= bound || p.x <= -bound)
     v.x = -elasticity * v.x;
   if (p.y >= bound || p.y <= -bound)
@@ -146,6 +707,7 @@ __kernel void update(__global float4* pos, __global float4* color,
 
   // Stay inside the box!
   p = clamp(p, -bound, bound);
+#endif
 
   // Write back to global memory.
   pos[i] = p;
@@ -155,3 +717,221 @@ __kernel void update(__global float4* pos, __global float4* color,
   color[i] = clamp((p + bound) / (2 * bound), 0.2f, 1.f);
   color[i].w = 1.f;  // Leave alpha alone.
 }
+
+
+// Semi-implicit Euler: a full kick followed by a drift.
+__kernel void update(__global float4* pos, __global float4* color,
+                     __global float4* force, __global float4* vel) {
+  // Get our index in the array.
+  size_t i = get_global_id(0);
+  // Copy position, velocity, and force for this iteration to a local variable.
+  float4 p = pos[i];             // Angstrom.
+  float4 f = force[i];           // Newton = Kilogram * Meter/Second^2.
+  float4 a = f / MASS;           // Meter/Second^2.
+  float4 v = vel[i];             // Meter/S.
+  v += a * DT;
+  drift_to(pos, color, vel, i, p, v);
+}
+
+
+// Velocity Verlet is kick, drift, force, kick, with half a time step per
+// kick. The forces at the end of one step are those at the start of the
+// next.
+__kernel void kick(__global float4* force, __global float4* vel) {
+  // Get our index in the array.
+  size_t i = get_global_id(0);
+  vel[i] += force[i] / MASS * (0.5f * DT);
+}
+
+
+__kernel void drift(__global float4* pos, __global float4* color,
+                    __global float4* vel) {
+  // Get our index in the array.
+  size_t i = get_global_id(0);
+  drift_to(pos, color, vel, i, pos[i], vel[i]);
+}
+
+
+// Thermostats. THERMOSTAT is 1 for Berendsen, 2 for Langevin and 3 for
+// Nose-Hoover, with target temperature TEMP (Kelvin) and coupling time TAU
+// (seconds). They act on the velocities after each step. The thermostat
+// state lives in thermo[0]: x the last measured temperature, y the velocity
+// scale for this step, z the Nose-Hoover friction.
+#define KB 1.380649e-23f       // Boltzmann constant, Joule/Kelvin.
+#ifndef REDUCE_SIZE
+#define REDUCE_SIZE 128
+#endif
+#ifndef THERMOSTAT
+#define THERMOSTAT 0
+#endif
+#ifndef TEMP
+#define TEMP 300.f
+#endif
+#ifndef TAU
+#define TAU 1e-13f
+#endif
+#ifndef SEED
+#define SEED 0u
+#endif
+
+
+// Sum the v^2 of each group of REDUCE_SIZE particles into partial.
+__kernel void ke_reduce(__global float4* vel, __global float* partial) {
+  __local float sums[REDUCE_SIZE];
+  size_t i = get_global_id(0);
+  size_t lx = get_local_id(0);
+  // The range is padded up to whole groups.
+  float4 v = i < NUM ? vel[i] : ZERO4;
+  sums[lx] = dot(v, v);
+  barrier(CLK_LOCAL_MEM_FENCE);
+  for (int s = REDUCE_SIZE / 2; s > 0; s >>= 1) {
+    if (lx < s)
+      sums[lx] += sums[lx + s];
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+  if (lx == 0)
+    partial[get_group_id(0)] = sums[0];
+}
+
+
+// Reduce the partial sums in a single group and update the thermostat.
+__kernel void ke_finish(__global float* partial, int num_partial,
+                        __global float4* thermo) {
+  __local float sums[REDUCE_SIZE];
+  size_t lx = get_local_id(0);
+  float sum = 0.f;
+  for (int k = lx; k < num_partial; k += REDUCE_SIZE)
+    sum += partial[k];
+  sums[lx] = sum;
+  barrier(CLK_LOCAL_MEM_FENCE);
+  for (int s = REDUCE_SIZE / 2; s > 0; s >>= 1) {
+    if (lx < s)
+      sums[lx] += sums[lx + s];
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+  if (lx != 0)
+    return;
+
+  float4 t = thermo[0];
+  // Equipartition over 3 degrees of freedom per particle.
+  t.x = MASS * sums[0] / (3 * NUM * KB);
+#if THERMOSTAT == 1
+  // Berendsen: relax toward TEMP with time constant TAU.
+  float ratio = t.x > 0 ? TEMP / t.x : 1.f;
+  t.y = clamp(sqrt(1 + DT / TAU * (ratio - 1)), 0.8f, 1.25f);
+#elif THERMOSTAT == 3
+  // Nose-Hoover: the friction integrates the temperature error.
+  t.z += DT / (TAU * TAU) * (t.x / TEMP - 1);
+  t.y = exp(-t.z * DT);
+#else
+  t.y = 1.f;
+#endif
+  thermo[0] = t;
+}
+
+
+// Counter-based random numbers: a PCG hash of (SEED, step, particle), so
+// every step draws fresh, reproducible noise with no state on the device.
+uint pcg_hash(uint x) {
+  uint state = x * 747796405u + 2891336453u;
+  uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+  return (word >> 22u) ^ word;
+}
+
+
+// Uniform in (0, 1).
+float pcg_uniform(uint h) {
+  return ((h >> 8) + 0.5f) * (1.f / 16777216.f);
+}
+
+
+__kernel void thermostat(__global float4* vel, __global float4* thermo,
+                         uint step) {
+  // Get our index in the array.
+  size_t i = get_global_id(0);
+#if THERMOSTAT == 2
+  // Langevin: exact friction plus matching noise over one time step.
+  float c1 = exp(-DT / TAU);
+  float c2 = sqrt((1 - c1 * c1) * KB * TEMP / MASS);  // Meter/Second.
+  uint h = pcg_hash(SEED ^ pcg_hash(step ^ pcg_hash(i)));
+  float u[4];
+  for (int k = 0; k < 4; k++) {
+    h = pcg_hash(h);
+    u[k] = pcg_uniform(h);
+  }
+  // Box-Muller, three of the four normals.
+  float r1 = sqrt(-2 * log(u[0])), r2 = sqrt(-2 * log(u[2]));
+  float4 g = (float4)(r1 * cos(2 * M_PI_F * u[1]), r1 * sin(2 * M_PI_F * u[1]),
+                      r2 * cos(2 * M_PI_F * u[3]), 0.f);
+  vel[i] = c1 * vel[i] + c2 * g;
+#else
+  vel[i] *= thermo[0].y;
+#endif
+}
+
+
+// Global observables from the per-particle energies and virials of an
+// OBSERVE build. Each group of REDUCE_SIZE particles sums into partial
+// (x: v^2, y: potential energy, z: virial), then observe_finish adds up the
+// groups into sums[0] (x: kinetic energy, y: potential energy, both Joule,
+// z: virial, Newton * Angstrom).
+void group_sum4(__local float4* sums, float4 x) {
+  size_t lx = get_local_id(0);
+  sums[lx] = x;
+  barrier(CLK_LOCAL_MEM_FENCE);
+  for (int s = REDUCE_SIZE / 2; s > 0; s >>= 1) {
+    if (lx < s)
+      sums[lx] += sums[lx + s];
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+}
+
+
+__kernel void observe_reduce(__global float4* vel, __global float2* observe,
+                             __global float4* partial) {
+  __local float4 sums[REDUCE_SIZE];
+  size_t i = get_global_id(0);
+  float4 x = ZERO4;
+  if (i < NUM) {
+    float4 v = vel[i];
+    x = (float4)(dot(v, v), observe[i].x, observe[i].y, 0.f);
+  }
+  group_sum4(sums, x);
+  if (get_local_id(0) == 0)
+    partial[get_group_id(0)] = sums[0];
+}
+
+
+__kernel void observe_finish(__global float4* partial, int num_partial,
+                             __global float4* totals) {
+  __local float4 sums[REDUCE_SIZE];
+  float4 x = ZERO4;
+  for (int k = get_local_id(0); k < num_partial; k += REDUCE_SIZE)
+    x += partial[k];
+  group_sum4(sums, x);
+  if (get_local_id(0) == 0)
+    totals[0] = (float4)(0.5f * MASS * sums[0].x, sums[0].y, sums[0].z, 0.f);
+}
+
+
+// Compressed trajectory positions: each coordinate on a grid of 1 /
+// inv_precision Angstrom from -BOUND, `bits` bits wide, as trajPack in
+// traj_format.hpp. The grid coordinates are kept in grid, and only their
+// change since the previous frame's (prev) goes to delta, one word per
+// particle: three 10-bit signed steps, x in the lowest bits, or the escape
+// bit alone if a step does not fit (see TRAJ_DELTA_BITS).
+__kernel void quantize(__global float4* pos, __global int4* prev,
+                       __global int4* grid, __global uint* delta,
+                       float inv_precision, uint bits) {
+  size_t i = get_global_id(0);
+  float4 g = clamp(rint((pos[i] + BOUND) * inv_precision), 0.f,
+                   (float)((1u << bits) - 1));
+  int4 q = convert_int4(g);
+  q.w = 0;
+  grid[i] = q;
+  int4 d = q - prev[i];
+  if (all(abs(d) < 512u))
+    delta[i] = (d.x & 1023) | (d.y & 1023) << 10 | (d.z & 1023) << 20;
+  else
+    delta[i] = 0x80000000u;
+}
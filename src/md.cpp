@@ -1,9 +1,13 @@
 #include <stdio.h>
+#include <string.h>
 #include <string>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <iterator>
+#include <iomanip>
+#include <algorithm>
+#include <math.h>
 
 
 // Needed for context sharing functions.
@@ -12,11 +16,53 @@
 
 // Local includes.
 #include "md.hpp"
+#include "energy.hpp"
+#include "trajectory.hpp"
+#include "program_cache.hpp"
 #include "util.hpp"
 #include "types.hpp"
 
 
-MD::MD() {
+MD::MD(bool headless_val) {
+  headless = headless_val;
+  cutoff = 10.f;
+  skin = 2.f;
+  use_cells = false;
+  use_nlist = false;
+  batch_step = 0;
+  overflow_host[0] = overflow_host[1] = 0;
+  program_cache = true;
+  fast_math = false;
+  iblock = 4;
+  jsplit = 0;
+  use_split = false;
+  nsplit = 1;
+  verlet = false;
+  have_forces = false;
+  pbc = false;
+  thermostat = THERMO_NONE;
+  thermo_every = 100;
+  step_count = 0;
+  thermo_host.s[0] = 0.f;
+  observe_every = 0;
+  bound = 50.f;
+  obs_ring = NULL;
+  obs_next = 0;
+  for (int i = 0; i < OBSERVE_RING; i++)
+    obs_slots[i].pending = false;
+  traj = NULL;
+  traj_every = 0;
+  traj_ring = NULL;
+  traj_next = 0;
+  traj_have_grid = false;
+  for (int i = 0; i < TRAJ_STAGING; i++)
+    traj_slots[i].pending = false;
+  phase_ids[PHASE_ACQUIRE] = profile.addPhase("acquire");
+  phase_ids[PHASE_NEIGHBOR] = profile.addPhase("neighbor");
+  phase_ids[PHASE_FORCE] = profile.addPhase("force");
+  phase_ids[PHASE_UPDATE] = profile.addPhase("update");
+  phase_ids[PHASE_OBSERVE] = profile.addPhase("observe");
+  phase_ids[PHASE_RELEASE] = profile.addPhase("release");
   printf("Initialize OpenCL object and context\n");
   // Setup devices and context.
   std::vector<cl::Platform> platforms;
@@ -39,8 +85,14 @@ MD::MD() {
       CL_CONTEXT_PLATFORM, (cl_context_properties)(platforms[0])(),
       0
     };
+  cl_context_properties headless_props[] =
+    {
+      CL_CONTEXT_PLATFORM, (cl_context_properties)(platforms[0])(),
+      0
+    };
   try {
-    context = cl::Context(CL_DEVICE_TYPE_GPU, props);
+    context = cl::Context(CL_DEVICE_TYPE_GPU,
+                          headless ? headless_props : props);
   }
   catch (cl::Error er) {
     printf("ERROR: %s(%s)\n", er.what(), oclErrorString(er.err()));
@@ -49,7 +101,9 @@ MD::MD() {
 
   // Create the command queue we will use to execute OpenCL commands.
   try {
-    queue = cl::CommandQueue(context, devices[deviceUsed], 0, &err);
+    // Profiling lets us time each phase of a step on the device.
+    queue = cl::CommandQueue(context, devices[deviceUsed],
+                             CL_QUEUE_PROFILING_ENABLE, &err);
   }
   catch (cl::Error er) {
     printf("ERROR: %s(%d)\n", er.what(), er.err());
@@ -70,73 +124,192 @@ std::string MD::loadFile(const char *filename) {
 }
 
 
-void MD::loadProgram(std::string kernel_source, int group_size_val) {
-  // Program Setup.
-  int pl;
+void MD::loadProgram(std::string kernel_source, int group_size_val,
+                     const sim_params &params) {
   group_size = group_size_val;
+  cutoff = params.cutoff;
+  program_source = kernel_source;
   printf("Load the program.\n");
+
+  std::stringstream build_options;
+  // Compile the constants in so the compiler can fold them. The group size
+  // is left out so autotune() can try several with one build.
+  build_options << "-D NUM=" << num;
+  build_options << std::scientific << std::setprecision(9)
+                << " -D SIGMA=" << params.sigma << "f"
+                << " -D EPSILON=" << params.epsilon << "f"
+                << " -D CUTOFF=" << cutoff << "f"
+                << " -D MASS=" << params.mass << "f"
+                << " -D ELASTICITY=" << params.elasticity << "f"
+                << " -D BOUND=" << params.bound << "f"
+                << " -D DT=" << params.dt << "f";
+  pbc = params.pbc;
+  if (pbc)
+    build_options << " -D PBC";
+  thermostat = thermostatId(params.thermostat);
+  if (thermostat > THERMO_NONE)
+    build_options << " -D THERMOSTAT=" << thermostat
+                  << " -D TEMP=" << params.temperature << "f"
+                  << " -D TAU=" << params.tau << "f"
+                  << " -D SEED=" << params.seed << "u";
+  build_options << " -D REDUCE_SIZE=" << REDUCE_SIZE;
+  build_options << " -D IBLOCK=" << iblock;
+  reference_options = build_options.str();
+
+  // The _fast kernels are the same kernels with the r^2 pair force.
+  std::string options = reference_options;
+  if (kernelBaseName(params.force_kernel_name) != params.force_kernel_name)
+    options += " -D LJ_FAST";
+  if (fast_math)
+    options += " -cl-fast-relaxed-math -cl-mad-enable";
+  program = buildProgram(kernel_source, options);
+
+  // The sampling steps run the force kernel from a second build that also
+  // stores the per-particle energies and virials.
+  observe_every = std::max(0, params.observe_every);
+  if (observe_every > 0)
+    observe_program = buildProgram(kernel_source, options + " -D OBSERVE");
+}
+
+
+cl::Program MD::buildProgram(const std::string &kernel_source,
+                             const std::string &options) {
+  // Program Setup.
+  int pl;
   bool failed = false;
+  cl::Program built;
 
-  pl = kernel_source.size();
-  printf("Kernel size: %d.\n", pl);
-  try {
-    cl::Program::Sources source(1,
-                                std::make_pair(kernel_source.c_str(), pl));
-    program = cl::Program(context, source);
-  }
-  catch (cl::Error er) {
-    printf("ERROR: %s(%s)\n", er.what(), oclErrorString(er.err()));
-  }
+  // Only the device we run on needs the program.
+  std::vector<cl::Device> build_devices(1, devices[deviceUsed]);
+  std::string cache_path;
+  bool cached = false;
+  if (program_cache) {
+    cl::Device &d = devices[deviceUsed];
+    std::string device = d.getInfo<CL_DEVICE_NAME>() + "\n" +
+      d.getInfo<CL_DEVICE_VENDOR>() + "\n" + d.getInfo<CL_DEVICE_VERSION>() +
+      "\n" + d.getInfo<CL_DRIVER_VERSION>();
+    cache_path = programCachePath(kernel_source, device, options);
 
-  printf("Building program...\n");
-  try {
-    //err = program.build(devices, "-cl-nv-verbose -cl-nv-maxrregcount=100");
-    std::stringstream build_options;
-    // Define the group size to allow for __local arrays.
-    build_options << "-D SIZE=" << group_size << std::ends;
-    err = program.build(devices, build_options.str().c_str());
+    std::vector<char> binary;
+    if (programCacheLoad(cache_path, &binary)) {
+      printf("Loading cached program %s\n", cache_path.c_str());
+      try {
+        cl::Program::Binaries binaries(1, std::make_pair(&binary[0],
+                                                         binary.size()));
+        built = cl::Program(context, build_devices, binaries);
+        err = built.build(build_devices, options.c_str());
+        cached = true;
+      }
+      catch (cl::Error er) {
+        // Stale or foreign binary, compile from source instead.
+        printf("Cached program unusable: %s(%s)\n", er.what(),
+               oclErrorString(er.err()));
+      }
+    }
   }
-  catch (cl::Error er) {
-    printf("program.build: %s\n", oclErrorString(er.err()));
-    failed = true;
+
+  if (!cached) {
+    pl = kernel_source.size();
+    printf("Kernel size: %d.\n", pl);
+    try {
+      cl::Program::Sources source(1,
+                                  std::make_pair(kernel_source.c_str(), pl));
+      built = cl::Program(context, source);
+    }
+    catch (cl::Error er) {
+      printf("ERROR: %s(%s)\n", er.what(), oclErrorString(er.err()));
+    }
+
+    printf("Building program...\n");
+    try {
+      //err = program.build(devices, "-cl-nv-verbose -cl-nv-maxrregcount=100");
+      err = built.build(build_devices, options.c_str());
+    }
+    catch (cl::Error er) {
+      printf("program.build: %s\n", oclErrorString(er.err()));
+      failed = true;
+    }
+    printf("Done building program.\n");
   }
-  printf("Done building program.\n");
   std::cout << "Build Status: "
-            << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(devices[0])
+            << built.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(devices[0])
             << std::endl;
   std::cout << "Build Options:\t"
-            << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(devices[0])
+            << built.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(devices[0])
             << std::endl;
   std::cout << "Build Log:\t "
-            << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0])
+            << built.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0])
             << std::endl;
 
   if (failed)
     exit(EXIT_FAILURE);
+
+  if (program_cache && !cached) {
+    // Save the binary for the next run.
+    try {
+      std::vector< ::size_t> sizes =
+        built.getInfo<CL_PROGRAM_BINARY_SIZES>();
+      std::vector<char> binary(sizes[0]);
+      std::vector<char *> binaries(1, binary.empty() ? NULL : &binary[0]);
+      err = built.getInfo(CL_PROGRAM_BINARIES, &binaries);
+      programCacheStore(cache_path, binary);
+    }
+    catch (cl::Error er) {
+      printf("ERROR: %s(%s)\n", er.what(), oclErrorString(er.err()));
+    }
+  }
+  return built;
 }
 
 
-void MD::loadData(std::vector<cl_float4> pos, std::vector<cl_float4> force,
-                  std::vector<cl_float4> vel, std::vector<cl_float4> col) {
+void MD::loadData(const std::vector<cl_float4> &pos,
+                  const std::vector<cl_float4> &force,
+                  const std::vector<cl_float4> &vel,
+                  const std::vector<cl_float4> &col) {
   // Store the number of particles and the size in bytes of our arrays.
   num = pos.size();
   array_size = num * sizeof(cl_float4);
-  // Create VBOs (defined in util.cpp).
-  pos_vbo = createVBO(&pos[0], array_size, GL_ARRAY_BUFFER, GL_DYNAMIC_DRAW);
-  col_vbo = createVBO(&col[0], array_size, GL_ARRAY_BUFFER, GL_DYNAMIC_DRAW);
 
-  // Make sure OpenGL is finished before we proceed.
-  glFinish();
-  printf("Set up GL sharing.\n");
-  try {
-    // Create OpenCL buffer from GL VBO.
-    // We don't need to push any data here because it's already in the VBO.
-    cl_vbos.push_back(cl::BufferGL(context, CL_MEM_READ_WRITE, pos_vbo, &err));
-    cl_vbos.push_back(cl::BufferGL(context, CL_MEM_READ_WRITE, col_vbo, &err));
-  }
-  catch (cl::Error er) {
-    printf("ERROR: %s(%s)\n", er.what(), oclErrorString(er.err()));
-    exit(EXIT_FAILURE);
+  if (headless) {
+    // Without GL the positions and colors live in ordinary buffers.
+    pos_vbo = col_vbo = 0;
+    try {
+      cl_pos = cl::Buffer(context, CL_MEM_READ_WRITE, array_size, NULL, &err);
+      cl_col = cl::Buffer(context, CL_MEM_READ_WRITE, array_size, NULL, &err);
+      err = queue.enqueueWriteBuffer(cl_pos, CL_TRUE, 0, array_size, &pos[0],
+                                     NULL, &event);
+      err = queue.enqueueWriteBuffer(cl_col, CL_TRUE, 0, array_size, &col[0],
+                                     NULL, &event);
+      cl_vbos.push_back(cl_pos);
+      cl_vbos.push_back(cl_col);
+      cl_pos_buffer = cl_pos;
+    }
+    catch (cl::Error er) {
+      printf("ERROR: %s(%s)\n", er.what(), oclErrorString(er.err()));
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    // Create VBOs (defined in util.cpp).
+    pos_vbo = createVBO(&pos[0], array_size, GL_ARRAY_BUFFER,
+                        GL_DYNAMIC_DRAW);
+    col_vbo = createVBO(&col[0], array_size, GL_ARRAY_BUFFER,
+                        GL_DYNAMIC_DRAW);
+
+    // Make sure OpenGL is finished before we proceed.
+    glFinish();
+    printf("Set up GL sharing.\n");
+    try {
+      // Create OpenCL buffer from GL VBO.
+      // We don't need to push any data here because it's already in the VBO.
+      cl_pos_buffer = cl::BufferGL(context, CL_MEM_READ_WRITE, pos_vbo, &err);
+      cl_vbos.push_back(cl_pos_buffer);
+      cl_vbos.push_back(cl::BufferGL(context, CL_MEM_READ_WRITE, col_vbo,
+                                     &err));
+    }
+    catch (cl::Error er) {
+      printf("ERROR: %s(%s)\n", er.what(), oclErrorString(er.err()));
+      exit(EXIT_FAILURE);
+    }
   }
 
   // Create the OpenCL only arrays.
@@ -155,11 +328,13 @@ void MD::loadData(std::vector<cl_float4> pos, std::vector<cl_float4> force,
 }
 
 
-void MD::clInit(float bound, float dt, std::string force_kernel_name) {
+void MD::clInit(float bound, std::string force_kernel_name, float skin_val) {
   printf("Initializing CL Kernels.\n");
+  skin = skin_val;
+  force_kernel_base = kernelBaseName(force_kernel_name);
   // Initialize our kernel from the program.
   try {
-    forceKernel = cl::Kernel(program, force_kernel_name.c_str(), &err);
+    forceKernel = cl::Kernel(program, force_kernel_base.c_str(), &err);
     updateKernel = cl::Kernel(program, "update", &err);
   }
   catch (cl::Error er) {
@@ -168,16 +343,21 @@ void MD::clInit(float bound, float dt, std::string force_kernel_name) {
   }
   // Set the arguements of our kernel.
   try {
-    err = forceKernel.setArg(0, cl_vbos[0]);  // Position vbo.
-    err = forceKernel.setArg(1, cl_vbos[1]);  // Color vbo.
-    err = forceKernel.setArg(2, cl_forces);
-    err = forceKernel.setArg(3, num);          // Pass in the size.
+    if (force_kernel_base == "force_cell") {
+      cellInit(bound, cutoff);
+      // The grid is rebuilt every step.
+      cl_int one = 1;
+      err = queue.enqueueWriteBuffer(cl_rebuild, CL_TRUE, 0, sizeof(cl_int),
+                                     &one, NULL, &event);
+    }
+    if (force_kernel_base == "force_nlist")
+      nlistInit(bound);
+    splitInit();
+    setForceArgs(forceKernel, cl_forces);
     err = updateKernel.setArg(0, cl_vbos[0]);  // Position vbo.
     err = updateKernel.setArg(1, cl_vbos[1]);  // Color vbo.
     err = updateKernel.setArg(2, cl_forces);
     err = updateKernel.setArg(3, cl_vel);
-    err = updateKernel.setArg(4, bound);
-    updateKernel.setArg(5, dt);                // Pass in the timestep.
   }
   catch (cl::Error er) {
     printf("ERROR: %s(%s)\n", er.what(), oclErrorString(er.err()));
@@ -188,39 +368,1003 @@ void MD::clInit(float bound, float dt, std::string force_kernel_name) {
 }
 
 
-void MD::runKernel() {
+void MD::setForceArgs(cl::Kernel &kernel, cl::Buffer &forces) {
+  err = kernel.setArg(0, cl_vbos[0]);  // Position vbo.
+  err = kernel.setArg(1, cl_vbos[1]);  // Color vbo.
+  // The split kernels leave their slices to force_split_sum.
+  err = kernel.setArg(2, use_split ? cl_split_partial : forces);
+  if (force_kernel_base == "force_tile" ||
+      force_kernel_base == "force_tile_clip")
+    err = kernel.setArg(3, cl::__local(group_size * sizeof(cl_float4)));
+  // Two tiles, one in use and one being copied in.
+  if (force_kernel_base == "force_block" ||
+      force_kernel_base == "force_block_clip")
+    err = kernel.setArg(3, cl::__local(2 * group_size * sizeof(cl_float4)));
+  if (force_kernel_base == "force_cell") {
+    err = kernel.setArg(3, cl_cells);
+    err = kernel.setArg(4, cl_cell_count);
+    err = kernel.setArg(5, cell_size);
+    err = kernel.setArg(6, cell_dims);
+    err = kernel.setArg(7, cell_cap);
+  }
+  if (force_kernel_base == "force_nlist") {
+    err = kernel.setArg(3, cl_neighbors);
+    err = kernel.setArg(4, cl_neighbor_count);
+  }
+}
+
+
+void MD::init(const sim_params &params) {
+  clInit(params.bound, params.force_kernel_name, params.skin);
+
+  if (params.integrator == "verlet") {
+    verlet = true;
+    try {
+      kickKernel = cl::Kernel(program, "kick", &err);
+      driftKernel = cl::Kernel(program, "drift", &err);
+      err = kickKernel.setArg(0, cl_forces);
+      err = kickKernel.setArg(1, cl_vel);
+      err = driftKernel.setArg(0, cl_vbos[0]);  // Position vbo.
+      err = driftKernel.setArg(1, cl_vbos[1]);  // Color vbo.
+      err = driftKernel.setArg(2, cl_vel);
+    }
+    catch (cl::Error er) {
+      printf("ERROR: %s(%s)\n", er.what(), oclErrorString(er.err()));
+      exit(EXIT_FAILURE);
+    }
+  } else if (params.integrator != "euler") {
+    printf("ERROR: unknown integrator %s\n", params.integrator.c_str());
+    exit(EXIT_FAILURE);
+  }
+  thermoInit(params);
+  bound = params.bound;
+  if (observe_every > 0)
+    observeInit();
+}
+
+
+void MD::autotune(const sim_params &params, std::string *kernel_name,
+                  int *group_size_out) {
+  // Only kernels that compute the same forces are interchangeable, and the
+  // _fast ones need their own build.
+  std::string base = kernelBaseName(params.force_kernel_name);
+  std::string fast = base != params.force_kernel_name ? "_fast" : "";
+  std::vector<std::string> kernels;
+  if (allPairsKernel(base)) {
+    kernels.push_back("force_naive");
+    kernels.push_back("force_tile");
+    kernels.push_back("force_block");
+    kernels.push_back("force_split");
+  } else {
+    kernels.push_back("force_naive_clip");
+    kernels.push_back("force_tile_clip");
+    kernels.push_back("force_block_clip");
+    kernels.push_back("force_split_clip");
+    kernels.push_back("force_cell");
+    kernels.push_back("force_nlist");
+  }
+
+  skin = params.skin;
+  cl::Device &d = devices[deviceUsed];
+  std::stringstream key;
+  key << d.getInfo<CL_DEVICE_NAME>() << "|" << d.getInfo<CL_DRIVER_VERSION>()
+      << "|" << kernels[0] << fast << "|num=" << num << std::setprecision(3)
+      << "|density=" << num / (8.0 * params.bound * params.bound * params.bound)
+      << "|cutoff=" << params.cutoff << "|skin=" << params.skin
+      << "|pbc=" << params.pbc << "|fast_math=" << fast_math
+      << "|iblock=" << iblock
+      << "|jsplit=" << jsplit;
+  std::string cached;
+  if (tuningCacheLoad(key.str(), &cached)) {
+    std::stringstream in(cached);
+    std::string name;
+    int g = 0;
+    in >> name >> g;
+    if (g > 0) {
+      printf("Autotune: %s with group size %d, cached.\n", name.c_str(), g);
+      *kernel_name = name;
+      *group_size_out = group_size = g;
+      return;
+    }
+  }
+
+  size_t max_group = d.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+  cl_ulong local_mem = d.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+  std::string best;
+  int best_group = 0;
+  double best_ms = 0;
+  for (size_t k = 0; k < kernels.size(); k++) {
+    // With PBC the cell grid must be at least 3 cells wide.
+    float radius = kernels[k] == "force_nlist" ? cutoff + params.skin : cutoff;
+    bool grid = kernels[k] == "force_cell" || kernels[k] == "force_nlist";
+    if (grid && pbc && 2 * params.bound / radius < 3)
+      continue;
+    size_t tiles = 0;
+    if (kernels[k] == "force_tile" || kernels[k] == "force_tile_clip")
+      tiles = 1;
+    if (kernels[k] == "force_block" || kernels[k] == "force_block_clip")
+      tiles = 2;
+    // Past num the groups would be mostly padding.
+    for (int g = 8; g < 2 * num && (size_t)g <= max_group; g *= 2) {
+      if (tiles * g * sizeof(cl_float4) > local_mem)
+        continue;
+      double ms = timeForce(kernels[k], g, params.bound);
+      if (ms < 0)
+        continue;
+      printf("Autotune: %-18s group size %4d  %.3f ms\n", kernels[k].c_str(),
+             g, ms);
+      if (best.empty() || ms < best_ms) {
+        best = kernels[k];
+        best_group = g;
+        best_ms = ms;
+      }
+    }
+  }
+  // Leave the neighbor structures and slices to init.
+  use_cells = use_nlist = use_split = false;
+  if (best.empty()) {
+    printf("Autotune: no kernel ran, keeping %s with group size %d.\n",
+           params.force_kernel_name.c_str(), group_size);
+    *kernel_name = params.force_kernel_name;
+    *group_size_out = group_size;
+    return;
+  }
+
+  best += fast;
+  printf("Autotune: %s with group size %d.\n", best.c_str(), best_group);
+  std::stringstream value;
+  value << best << " " << best_group;
+  tuningCacheStore(key.str(), value.str());
+  *kernel_name = best;
+  *group_size_out = group_size = best_group;
+}
+
+
+double MD::timeForce(const std::string &kernel_base, int g, float bound) {
+  const int reps = 10;
+  force_kernel_base = kernel_base;
+  group_size = g;
+  use_cells = use_nlist = false;
+  double total = 0;
+  try {
+    forceKernel = cl::Kernel(program, kernel_base.c_str(), &err);
+    size_t kernel_max = forceKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(
+      devices[deviceUsed]);
+    if ((size_t)g > kernel_max)
+      return -1;
+    if (kernel_base == "force_cell") {
+      cellInit(bound, cutoff);
+      cl_int one = 1;
+      err = queue.enqueueWriteBuffer(cl_rebuild, CL_TRUE, 0, sizeof(cl_int),
+                                     &one);
+    }
+    if (kernel_base == "force_nlist")
+      nlistInit(bound);
+    splitInit();
+    setForceArgs(forceKernel, cl_forces);
+
+    if (!headless) {
+      glFinish();
+      err = queue.enqueueAcquireGLObjects(&cl_vbos, NULL, NULL);
+    }
+    // One untimed run, then the neighbor upkeep and force of reps steps.
+    // The positions stay put, so the neighbor lists would only be built in
+    // the untimed run. A real run rebuilds them every so often, so charge
+    // for one rebuild in the timed steps.
+    for (int rep = 0; rep <= reps; rep++) {
+      if (rep == 1) {
+        queue.finish();
+        timed_events.clear();
+        if (use_nlist) {
+          cl_int one = 1;
+          err = queue.enqueueWriteBuffer(cl_rebuild, CL_TRUE, 0,
+                                         sizeof(cl_int), &one);
+        }
+      }
+      enqueueNeighbors();
+      enqueueForce(forceKernel, splitSumKernel);
+    }
+    if (!headless)
+      err = queue.enqueueReleaseGLObjects(&cl_vbos, NULL, NULL);
+    err = queue.finish();
+    for (size_t i = 0; i < timed_events.size(); i++) {
+      cl::Event &ev = timed_events[i].event;
+      total += (ev.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+                ev.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-6;
+    }
+  }
+  catch (cl::Error er) {
+    // Out of resources at this size, most likely.
+    printf("Autotune: %s with group size %d failed: %s(%s)\n",
+           kernel_base.c_str(), g, er.what(), oclErrorString(er.err()));
+    total = -reps;
+  }
+  timed_events.clear();
+  return total / reps;
+}
+
+
+void MD::thermoInit(const sim_params &params) {
+  if (thermostatId(params.thermostat) < 0) {
+    printf("ERROR: unknown thermostat %s\n", params.thermostat.c_str());
+    exit(EXIT_FAILURE);
+  }
+  thermo_every = std::max(1, params.thermo_every);
+  num_partial = (num + REDUCE_SIZE - 1) / REDUCE_SIZE;
+  try {
+    cl_ke_partial = cl::Buffer(context, CL_MEM_READ_WRITE,
+                               num_partial * sizeof(cl_float), NULL, &err);
+    cl_thermo = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_float4), NULL,
+                           &err);
+    // No friction yet, and unscaled velocities until the first reading.
+    cl_float4 t = f4(0.f, 1.f, 0.f, 0.f);
+    err = queue.enqueueWriteBuffer(cl_thermo, CL_TRUE, 0, sizeof(cl_float4),
+                                   &t, NULL, &event);
+    keReduceKernel = cl::Kernel(program, "ke_reduce", &err);
+    keFinishKernel = cl::Kernel(program, "ke_finish", &err);
+    thermostatKernel = cl::Kernel(program, "thermostat", &err);
+    err = keReduceKernel.setArg(0, cl_vel);
+    err = keReduceKernel.setArg(1, cl_ke_partial);
+    err = keFinishKernel.setArg(0, cl_ke_partial);
+    err = keFinishKernel.setArg(1, num_partial);
+    err = keFinishKernel.setArg(2, cl_thermo);
+    err = thermostatKernel.setArg(0, cl_vel);
+    err = thermostatKernel.setArg(1, cl_thermo);
+  }
+  catch (cl::Error er) {
+    printf("ERROR: %s(%s)\n", er.what(), oclErrorString(er.err()));
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+void MD::enqueueThermostat() {
+  step_count++;
+  // Berendsen and Nose-Hoover need the temperature every step, the others
+  // only when it is reported.
+  bool report = step_count % thermo_every == 0;
+  bool scale = thermostat == THERMO_BERENDSEN ||
+    thermostat == THERMO_NOSE_HOOVER;
+  if (report || scale) {
+    enqueueKernel(keReduceKernel, cl::NDRange(num_partial * REDUCE_SIZE),
+                  cl::NDRange(REDUCE_SIZE), PHASE_UPDATE);
+    enqueueKernel(keFinishKernel, cl::NDRange(REDUCE_SIZE),
+                  cl::NDRange(REDUCE_SIZE), PHASE_UPDATE);
+  }
+  if (report) {
+    // Lands by the end of the batch, which waits on the queue anyway.
+    err = queue.enqueueReadBuffer(cl_thermo, CL_FALSE, 0, sizeof(cl_float4),
+                                  &thermo_host);
+  }
+  if (thermostat != THERMO_NONE) {
+    err = thermostatKernel.setArg(2, step_count);
+    enqueueKernel(thermostatKernel, cl::NDRange(num), cl::NullRange,
+                  PHASE_UPDATE);
+  }
+}
+
+
+float MD::temperature() {
+  return thermo_host.s[0];
+}
+
+
+void MD::observeInit() {
+  size_t ring_size = OBSERVE_RING * sizeof(cl_float4);
+  try {
+    cl_observe = cl::Buffer(context, CL_MEM_READ_WRITE, num * sizeof(cl_float2),
+                            NULL, &err);
+    cl_obs_partial = cl::Buffer(context, CL_MEM_READ_WRITE,
+                                num_partial * sizeof(cl_float4), NULL, &err);
+    cl_obs_totals = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_float4),
+                               NULL, &err);
+    // Pinned, so the copies are plain DMA and can overlap the next steps.
+    cl_obs_pinned = cl::Buffer(context,
+                               CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+                               ring_size, NULL, &err);
+    obs_ring = (cl_float4 *)queue.enqueueMapBuffer(cl_obs_pinned, CL_TRUE,
+                                                   CL_MAP_READ | CL_MAP_WRITE,
+                                                   0, ring_size);
+
+    observeForceKernel = cl::Kernel(observe_program, force_kernel_base.c_str(),
+                                    &err);
+    setForceArgs(observeForceKernel, cl_forces);
+    // The observe buffer is the last argument of every force kernel, or of
+    // force_split_sum for the split ones.
+    if (use_split)
+      observeSplitSumKernel = makeSplitSum(observe_program, cl_forces);
+    cl::Kernel &out = use_split ? observeSplitSumKernel : observeForceKernel;
+    cl_uint nargs = out.getInfo<CL_KERNEL_NUM_ARGS>();
+    err = out.setArg(nargs - 1, cl_observe);
+    observeReduceKernel = cl::Kernel(observe_program, "observe_reduce", &err);
+    observeFinishKernel = cl::Kernel(observe_program, "observe_finish", &err);
+    err = observeReduceKernel.setArg(0, cl_vel);
+    err = observeReduceKernel.setArg(1, cl_observe);
+    err = observeReduceKernel.setArg(2, cl_obs_partial);
+    err = observeFinishKernel.setArg(0, cl_obs_partial);
+    err = observeFinishKernel.setArg(1, num_partial);
+    err = observeFinishKernel.setArg(2, cl_obs_totals);
+  }
+  catch (cl::Error er) {
+    printf("ERROR: %s(%s)\n", er.what(), oclErrorString(er.err()));
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+bool MD::observeStep() const {
+  // step_count is advanced at the end of each step.
+  return observe_every > 0 && (step_count + 1) % observe_every == 0;
+}
+
+
+void MD::enqueueObserve() {
+  enqueueKernel(observeReduceKernel, cl::NDRange(num_partial * REDUCE_SIZE),
+                cl::NDRange(REDUCE_SIZE), PHASE_OBSERVE);
+  enqueueKernel(observeFinishKernel, cl::NDRange(REDUCE_SIZE),
+                cl::NDRange(REDUCE_SIZE), PHASE_OBSERVE);
+
+  // If the ring is full, the oldest sample has to land before its slot can
+  // be reused. It was enqueued OBSERVE_RING samples ago, so is likely done.
+  obs_slot &slot = obs_slots[obs_next];
+  if (slot.pending)
+    collectObservables(obs_next);
+  slot.step = step_count;
+  slot.pending = true;
+  err = queue.enqueueReadBuffer(cl_obs_totals, CL_FALSE, 0, sizeof(cl_float4),
+                                &obs_ring[obs_next], NULL, &slot.event);
+  obs_next = (obs_next + 1) % OBSERVE_RING;
+}
+
+
+void MD::collectObservables(int k) {
+  obs_slot &slot = obs_slots[k];
+  slot.event.wait();
+  slot.pending = false;
+  const cl_float4 &t = obs_ring[k];
+  // The virial comes in Newton * Angstrom.
+  obs_samples.push_back(makeObservables(slot.step, t.s[0], t.s[1],
+                                        t.s[2] * 1e-10, num, bound));
+}
+
+
+void MD::takeObservables(std::vector<observables> *out) {
+  out->insert(out->end(), obs_samples.begin(), obs_samples.end());
+  obs_samples.clear();
+}
+
+
+void MD::setTrajectory(TrajectoryWriter *writer, int every) {
+  traj = writer;
+  traj_every = std::max(1, every);
+  size_t ring_size = TRAJ_STAGING * 2 * array_size;
+  try {
+    if (traj->compressed()) {
+      cl_traj_delta = cl::Buffer(context, CL_MEM_WRITE_ONLY,
+                                 num * sizeof(cl_uint), NULL, &err);
+      for (int k = 0; k < TRAJ_STAGING; k++)
+        cl_traj_grid[k] = cl::Buffer(context, CL_MEM_READ_WRITE,
+                                     num * sizeof(cl_int4), NULL, &err);
+      traj_grid.resize(3 * num);
+      traj_have_grid = false;
+      quantizeKernel = cl::Kernel(program, "quantize", &err);
+      err = quantizeKernel.setArg(0, cl_pos_buffer);
+      err = quantizeKernel.setArg(3, cl_traj_delta);
+      err = quantizeKernel.setArg(4, 1.f / traj->precision());
+      err = quantizeKernel.setArg(5, (cl_uint)traj->bits());
+    }
+    cl_traj_pinned = cl::Buffer(context,
+                                CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+                                ring_size, NULL, &err);
+    traj_ring = (cl_float4 *)queue.enqueueMapBuffer(cl_traj_pinned, CL_TRUE,
+                                                    CL_MAP_READ | CL_MAP_WRITE,
+                                                    0, ring_size);
+  }
+  catch (cl::Error er) {
+    printf("ERROR: %s(%s)\n", er.what(), oclErrorString(er.err()));
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+void MD::saveState(engine_state *out) {
+  out->step = step_count;
+  out->pos.resize(num);
+  out->vel.resize(num);
+  out->force.resize(num);
+  try {
+    if (!headless) {
+      glFinish();
+      err = queue.enqueueAcquireGLObjects(&cl_vbos, NULL, NULL);
+    }
+    err = queue.enqueueReadBuffer(cl_pos_buffer, CL_FALSE, 0, array_size,
+                                  &out->pos[0]);
+    if (!headless)
+      err = queue.enqueueReleaseGLObjects(&cl_vbos, NULL, NULL);
+    err = queue.enqueueReadBuffer(cl_vel, CL_FALSE, 0, array_size,
+                                  &out->vel[0]);
+    err = queue.enqueueReadBuffer(cl_forces, CL_FALSE, 0, array_size,
+                                  &out->force[0]);
+    err = queue.enqueueReadBuffer(cl_thermo, CL_TRUE, 0, sizeof(cl_float4),
+                                  &out->thermo);
+    if (use_nlist) {
+      // Rebuild from these positions, as the restarted run will.
+      cl_int one = 1;
+      err = queue.enqueueWriteBuffer(cl_rebuild, CL_TRUE, 0, sizeof(cl_int),
+                                     &one);
+    }
+  }
+  catch (cl::Error er) {
+    printf("ERROR: %s(%s)\n", er.what(), oclErrorString(er.err()));
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+void MD::restoreState(const engine_state &in) {
+  if ((int)in.pos.size() != num) {
+    printf("ERROR: the saved state has %d particles, not %d\n",
+           (int)in.pos.size(), num);
+    exit(EXIT_FAILURE);
+  }
+  step_count = in.step;
+  thermo_host = in.thermo;
+  // The next compressed frame can't follow on the last one.
+  traj_have_grid = false;
+  try {
+    if (!headless) {
+      glFinish();
+      err = queue.enqueueAcquireGLObjects(&cl_vbos, NULL, NULL);
+    }
+    err = queue.enqueueWriteBuffer(cl_pos_buffer, CL_FALSE, 0, array_size,
+                                   &in.pos[0]);
+    if (!headless)
+      err = queue.enqueueReleaseGLObjects(&cl_vbos, NULL, NULL);
+    err = queue.enqueueWriteBuffer(cl_vel, CL_FALSE, 0, array_size,
+                                   &in.vel[0]);
+    err = queue.enqueueWriteBuffer(cl_forces, CL_FALSE, 0, array_size,
+                                   &in.force[0]);
+    err = queue.enqueueWriteBuffer(cl_thermo, CL_TRUE, 0, sizeof(cl_float4),
+                                   &in.thermo);
+  }
+  catch (cl::Error er) {
+    printf("ERROR: %s(%s)\n", er.what(), oclErrorString(er.err()));
+    exit(EXIT_FAILURE);
+  }
+  // The saved forces are those at the saved positions.
+  have_forces = true;
+}
+
+
+void MD::enqueueTrajectory() {
+  // Make room by passing on the oldest frame, which was enqueued
+  // TRAJ_STAGING frames ago.
+  traj_slot &slot = traj_slots[traj_next];
+  if (slot.pending)
+    handTrajectory(traj_next);
+  cl_float4 *pos = traj_ring + 2 * num * traj_next;
+  slot.step = step_count;
+  slot.pending = true;
+  if (traj->velocities())
+    err = queue.enqueueReadBuffer(cl_vel, CL_FALSE, 0, array_size, pos + num);
+  // The queue is in order, so this read finishing means both have.
+  slot.absolute = !traj_have_grid;
+  if (traj->compressed()) {
+    int prev = (traj_next + TRAJ_STAGING - 1) % TRAJ_STAGING;
+    err = quantizeKernel.setArg(1, cl_traj_grid[prev]);
+    err = quantizeKernel.setArg(2, cl_traj_grid[traj_next]);
+    enqueueKernel(quantizeKernel, cl::NDRange(num), cl::NullRange,
+                  PHASE_OBSERVE);
+    if (slot.absolute)
+      err = queue.enqueueReadBuffer(cl_traj_grid[traj_next], CL_FALSE, 0,
+                                    num * sizeof(cl_int4), pos, NULL,
+                                    &slot.event);
+    else
+      err = queue.enqueueReadBuffer(cl_traj_delta, CL_FALSE, 0,
+                                    num * sizeof(cl_uint), pos, NULL,
+                                    &slot.event);
+    traj_have_grid = true;
+  } else {
+    err = queue.enqueueReadBuffer(cl_pos_buffer, CL_FALSE, 0, array_size, pos,
+                                  NULL, &slot.event);
+  }
+  traj_next = (traj_next + 1) % TRAJ_STAGING;
+}
+
+
+void MD::handTrajectory(int k) {
+  traj_slot &slot = traj_slots[k];
+  slot.event.wait();
+  slot.pending = false;
+  const cl_float4 *pos = traj_ring + 2 * num * k;
+  const cl_float4 *vel = pos + num;
+  if (traj->compressed()) {
+    // Until the next frame with this slot is enqueued, its grid buffer
+    // still holds this frame, for the rare step too large for a word.
+    std::vector<cl_int4> grid;
+    const cl_int4 *abs_grid = (const cl_int4 *)pos;
+    const cl_uint *delta = (const cl_uint *)pos;
+    for (int i = 0; i < num; i++) {
+      if (slot.absolute || !trajApplyDelta(delta[i], &traj_grid[3 * i])) {
+        if (!slot.absolute && grid.empty()) {
+          grid.resize(num);
+          try {
+            err = queue.enqueueReadBuffer(cl_traj_grid[k], CL_TRUE, 0,
+                                          num * sizeof(cl_int4), &grid[0]);
+          }
+          catch (cl::Error er) {
+            printf("ERROR: %s(%s)\n", er.what(), oclErrorString(er.err()));
+            exit(EXIT_FAILURE);
+          }
+          abs_grid = &grid[0];
+        }
+        for (int c = 0; c < 3; c++)
+          traj_grid[3 * i + c] = abs_grid[i].s[c];
+      }
+    }
+  }
+  TrajectoryWriter::frame &f = traj->begin();
+  f.step = slot.step;
+  if (traj->compressed()) {
+    int words = traj->words();
+    for (int i = 0; i < num; i++)
+      trajPackGrid(&traj_grid[3 * i], traj->bits(), &f.packed[words * i]);
+  }
+  for (int i = 0; i < num; i++) {
+    for (int c = 0; c < 3; c++) {
+      if (!traj->compressed())
+        f.pos[3 * i + c] = pos[i].s[c];
+      if (traj->velocities())
+        f.vel[3 * i + c] = vel[i].s[c];
+    }
+  }
+  traj->commit();
+}
+
+
+void MD::cellInit(float bound, float radius) {
+  // Cells must be at least as wide as the search radius so that all
+  // neighbors are within one cell in each direction.
+  int n = std::max(1, (int)floor(2 * bound / radius));
+  if (pbc && n < 3) {
+    // The wrapped 3x3x3 search would see some cells twice.
+    printf("ERROR: with PBC the box must be at least 3 cells (%f A) wide\n",
+           3 * radius);
+    exit(EXIT_FAILURE);
+  }
+  cell_size = 2 * bound / n;
+  cell_dims.s[0] = cell_dims.s[1] = cell_dims.s[2] = n;
+  cell_dims.s[3] = 1;
+  num_cells = n * n * n;
+  // Leave plenty of headroom over the average occupancy since particles pile
+  // up against the walls.
+  int avg = (num + num_cells - 1) / num_cells;
+  cell_cap = std::max(32, 4 * avg);
+  printf("Cell grid: %d^3 cells of %f A, %d slots per cell.\n", n, cell_size,
+         cell_cap);
+
+  try {
+    cl_cells = cl::Buffer(context, CL_MEM_READ_WRITE,
+                          (size_t)num_cells * cell_cap * sizeof(cl_int), NULL,
+                          &err);
+    cl_cell_count = cl::Buffer(context, CL_MEM_READ_WRITE,
+                               num_cells * sizeof(cl_int), NULL, &err);
+    cl_rebuild = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int), NULL,
+                            &err);
+    cl_overflow = cl::Buffer(context, CL_MEM_READ_WRITE, 2 * sizeof(cl_int),
+                             NULL, &err);
+    cl_int zero[2] = {0, 0};
+    err = queue.enqueueWriteBuffer(cl_overflow, CL_TRUE, 0, sizeof(zero),
+                                   zero);
+    cellClearKernel = cl::Kernel(program, "cell_clear", &err);
+    cellBinKernel = cl::Kernel(program, "cell_bin", &err);
+    err = cellClearKernel.setArg(0, cl_cell_count);
+    err = cellClearKernel.setArg(1, cl_rebuild);
+    err = cellBinKernel.setArg(0, cl_vbos[0]);  // Position vbo.
+    err = cellBinKernel.setArg(1, cl_cells);
+    err = cellBinKernel.setArg(2, cl_cell_count);
+    err = cellBinKernel.setArg(3, cell_size);
+    err = cellBinKernel.setArg(4, cell_dims);
+    err = cellBinKernel.setArg(5, cell_cap);
+    err = cellBinKernel.setArg(6, cl_rebuild);
+    err = cellBinKernel.setArg(7, cl_overflow);
+  }
+  catch (cl::Error er) {
+    printf("ERROR: %s(%s)\n", er.what(), oclErrorString(er.err()));
+    exit(EXIT_FAILURE);
+  }
+  use_cells = true;
+}
+
+
+void MD::nlistInit(float bound) {
+  float radius = cutoff + skin;
+  cellInit(bound, radius);
+
+  // Size the lists for a few times the average number of particles within
+  // the list radius, again to leave room for crowding at the walls.
+  float volume = 8 * bound * bound * bound;
+  float sphere = 4.f / 3.f * M_PI * radius * radius * radius;
+  int avg = (int)ceil(num * std::min(sphere / volume, 1.f));
+  nlist_cap = std::max(64, 4 * avg);
+  printf("Neighbor lists: radius %f A, %d slots per particle.\n", radius,
+         nlist_cap);
+
+  try {
+    cl_neighbors = cl::Buffer(context, CL_MEM_READ_WRITE,
+                              (size_t)num * nlist_cap * sizeof(cl_int), NULL,
+                              &err);
+    cl_neighbor_count = cl::Buffer(context, CL_MEM_READ_WRITE,
+                                   num * sizeof(cl_int), NULL, &err);
+    cl_pos_ref = cl::Buffer(context, CL_MEM_READ_WRITE, array_size, NULL,
+                            &err);
+    nlistCheckKernel = cl::Kernel(program, "nlist_check", &err);
+    nlistBuildKernel = cl::Kernel(program, "nlist_build", &err);
+    nlistResetKernel = cl::Kernel(program, "nlist_reset", &err);
+    err = nlistCheckKernel.setArg(0, cl_vbos[0]);  // Position vbo.
+    err = nlistCheckKernel.setArg(1, cl_pos_ref);
+    err = nlistCheckKernel.setArg(2, cl_rebuild);
+    err = nlistCheckKernel.setArg(3, skin / 2);
+    err = nlistBuildKernel.setArg(0, cl_vbos[0]);  // Position vbo.
+    err = nlistBuildKernel.setArg(1, cl_pos_ref);
+    err = nlistBuildKernel.setArg(2, cl_neighbors);
+    err = nlistBuildKernel.setArg(3, cl_neighbor_count);
+    err = nlistBuildKernel.setArg(4, cl_cells);
+    err = nlistBuildKernel.setArg(5, cl_cell_count);
+    err = nlistBuildKernel.setArg(6, cell_size);
+    err = nlistBuildKernel.setArg(7, cell_dims);
+    err = nlistBuildKernel.setArg(8, cell_cap);
+    err = nlistBuildKernel.setArg(9, radius);
+    err = nlistBuildKernel.setArg(10, nlist_cap);
+    err = nlistBuildKernel.setArg(11, cl_rebuild);
+    err = nlistBuildKernel.setArg(12, cl_overflow);
+    err = nlistResetKernel.setArg(0, cl_rebuild);
+
+    // Force a build on the first step.
+    cl_int one = 1;
+    err = queue.enqueueWriteBuffer(cl_rebuild, CL_TRUE, 0, sizeof(cl_int),
+                                   &one, NULL, &event);
+  }
+  catch (cl::Error er) {
+    printf("ERROR: %s(%s)\n", er.what(), oclErrorString(er.err()));
+    exit(EXIT_FAILURE);
+  }
+  use_nlist = true;
+}
+
+
+void MD::growNeighbors() {
+  if (!use_cells)
+    return;
+  bool grow_cells = overflow_host[0] > cell_cap;
+  bool grow_lists = use_nlist && overflow_host[1] > nlist_cap;
+  if (!grow_cells && !grow_lists)
+    return;
+  if (grow_cells) {
+    int old_cap = cell_cap;
+    while (cell_cap < overflow_host[0])
+      cell_cap *= 2;
+    printf("Cell grid: %d particles in one cell, growing from %d to %d "
+           "slots.\n", overflow_host[0], old_cap, cell_cap);
+    cl_cells = cl::Buffer(context, CL_MEM_READ_WRITE,
+                          (size_t)num_cells * cell_cap * sizeof(cl_int), NULL,
+                          &err);
+    err = cellBinKernel.setArg(1, cl_cells);
+    err = cellBinKernel.setArg(5, cell_cap);
+  }
+  if (grow_lists) {
+    int old_cap = nlist_cap;
+    while (nlist_cap < overflow_host[1])
+      nlist_cap *= 2;
+    printf("Neighbor lists: %d neighbors of one particle, growing from %d to "
+           "%d slots.\n", overflow_host[1], old_cap, nlist_cap);
+    cl_neighbors = cl::Buffer(context, CL_MEM_READ_WRITE,
+                              (size_t)num * nlist_cap * sizeof(cl_int), NULL,
+                              &err);
+    err = nlistBuildKernel.setArg(2, cl_neighbors);
+    err = nlistBuildKernel.setArg(10, nlist_cap);
+    // The overflowing lists are marked, so rebuild them all into the new
+    // slots.
+    cl_int one = 1;
+    err = queue.enqueueWriteBuffer(cl_rebuild, CL_TRUE, 0, sizeof(cl_int),
+                                   &one);
+  }
+  overflow_host[0] = overflow_host[1] = 0;
+  err = queue.enqueueWriteBuffer(cl_overflow, CL_TRUE, 0,
+                                 sizeof(overflow_host), overflow_host);
+  if (use_nlist) {
+    err = nlistBuildKernel.setArg(4, cl_cells);
+    err = nlistBuildKernel.setArg(8, cell_cap);
+  }
+  setForceArgs(forceKernel, cl_forces);
+  if (observe_every > 0)
+    setForceArgs(observeForceKernel, cl_forces);
+}
+
+
+cl::NDRange MD::forceRange() const {
+  int items = num;
+  if (force_kernel_base == "force_block" ||
+      force_kernel_base == "force_block_clip")
+    items = (num + iblock - 1) / iblock;
+  return cl::NDRange((items + group_size - 1) / group_size * group_size);
+}
+
+
+void MD::enqueueKernel(cl::Kernel &kernel, const cl::NDRange &global,
+                       const cl::NDRange &local, int phase) {
+  cl::Event ev;
+  err = queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local, NULL,
+                                   &ev);
+  addTimedEvent(phase, batch_step, ev);
+}
+
+
+void MD::addTimedEvent(int phase, int step, const cl::Event &ev) {
+  timed_event t = {phase, step, ev};
+  timed_events.push_back(t);
+}
+
+
+void MD::enqueueForce(cl::Kernel &force, cl::Kernel &sum) {
+  if (!use_split) {
+    enqueueKernel(force, forceRange(), cl::NDRange(group_size), PHASE_FORCE);
+    return;
+  }
+  // One row of groups per slice.
+  enqueueKernel(force, cl::NDRange(forceRange()[0], nsplit),
+                cl::NDRange(group_size, 1), PHASE_FORCE);
+  enqueueKernel(sum, cl::NDRange(num), cl::NullRange, PHASE_FORCE);
+}
+
+
+void MD::splitInit() {
+  use_split = force_kernel_base == "force_split" ||
+              force_kernel_base == "force_split_clip";
+  if (!use_split)
+    return;
+  nsplit = jsplit;
+  if (nsplit <= 0) {
+    // Enough groups for a few per compute unit, in slices of at least 32
+    // particles.
+    cl_uint units =
+      devices[deviceUsed].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+    int groups = (num + group_size - 1) / group_size;
+    nsplit = std::min((4 * (int)units + groups - 1) / groups, num / 32);
+  }
+  nsplit = std::max(1, std::min(nsplit, num));
+  // The OBSERVE build stores the slices' energies and virials after the
+  // forces.
+  int slices = observe_every > 0 ? 2 * nsplit : nsplit;
+  cl_split_partial = cl::Buffer(context, CL_MEM_READ_WRITE,
+                                slices * array_size, NULL, &err);
+  splitSumKernel = makeSplitSum(program, cl_forces);
+}
+
+
+cl::Kernel MD::makeSplitSum(cl::Program &prog, cl::Buffer &forces) {
+  cl::Kernel sum(prog, "force_split_sum", &err);
+  err = sum.setArg(0, cl_split_partial);
+  err = sum.setArg(1, forces);
+  err = sum.setArg(2, nsplit);
+  return sum;
+}
+
+
+void MD::readVelocities(cl_float4 *vel) {
+  try {
+    err = queue.enqueueReadBuffer(cl_vel, CL_TRUE, 0, array_size, vel);
+  }
+  catch (cl::Error er) {
+    printf("ERROR: %s(%s)\n", er.what(), oclErrorString(er.err()));
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+void MD::enqueueNeighbors() {
+  if (use_nlist) {
+    // Decide on the device whether the lists need rebuilding. The binning
+    // and build kernels below return immediately if not.
+    enqueueKernel(nlistCheckKernel, cl::NDRange(num), cl::NullRange,
+                  PHASE_NEIGHBOR);
+  }
+  if (use_cells) {
+    // Rebin every particle before computing forces.
+    enqueueKernel(cellClearKernel, cl::NDRange(num_cells), cl::NullRange,
+                  PHASE_NEIGHBOR);
+    enqueueKernel(cellBinKernel, cl::NDRange(num), cl::NullRange,
+                  PHASE_NEIGHBOR);
+  }
+  if (use_nlist) {
+    enqueueKernel(nlistBuildKernel, cl::NDRange(num), cl::NullRange,
+                  PHASE_NEIGHBOR);
+    enqueueKernel(nlistResetKernel, cl::NDRange(1), cl::NullRange,
+                  PHASE_NEIGHBOR);
+  }
+}
+
+
+void MD::validate() {
+  // Compute the forces for the current positions with both our program and
+  // one built without LJ_FAST and fast-math, then compare.
+  printf("Validating %s forces against the reference build.\n",
+         force_kernel_base.c_str());
+  cl::Program reference = buildProgram(program_source, reference_options);
+  std::vector<cl_float4> f(num), f_ref(num);
+  try {
+    cl::Kernel ref_kernel(reference, force_kernel_base.c_str(), &err);
+    cl::Buffer ref_forces(context, CL_MEM_READ_WRITE, array_size, NULL, &err);
+    setForceArgs(ref_kernel, ref_forces);
+
+    if (!headless) {
+      glFinish();
+      err = queue.enqueueAcquireGLObjects(&cl_vbos, NULL, NULL);
+    }
+    // The queue is in order, so both can use the same slices.
+    cl::Kernel ref_sum;
+    if (use_split)
+      ref_sum = makeSplitSum(reference, ref_forces);
+    enqueueNeighbors();
+    enqueueForce(forceKernel, splitSumKernel);
+    enqueueForce(ref_kernel, ref_sum);
+    if (!headless)
+      err = queue.enqueueReleaseGLObjects(&cl_vbos, NULL, NULL);
+    err = queue.enqueueReadBuffer(cl_forces, CL_FALSE, 0, array_size, &f[0]);
+    err = queue.enqueueReadBuffer(ref_forces, CL_TRUE, 0, array_size,
+                                  &f_ref[0]);
+  }
+  catch (cl::Error er) {
+    printf("ERROR: %s(%s)\n", er.what(), oclErrorString(er.err()));
+    exit(EXIT_FAILURE);
+  }
+  // Not part of a step.
+  timed_events.clear();
+
+  double max_err = 0, max_ref = 0, sum_err = 0, sum_ref = 0;
+  for (int i = 0; i < num; i++) {
+    double e = 0, r = 0;
+    for (int k = 0; k < 3; k++) {
+      double d = (double)f[i].s[k] - f_ref[i].s[k];
+      e += d * d;
+      r += (double)f_ref[i].s[k] * f_ref[i].s[k];
+    }
+    max_err = std::max(max_err, sqrt(e));
+    max_ref = std::max(max_ref, sqrt(r));
+    sum_err += e;
+    sum_ref += r;
+  }
+  double rms_err = sqrt(sum_err / num), rms_ref = sqrt(sum_ref / num);
+  printf("Force error: max %e N (%e of max |F|), RMS %e N (%e of RMS |F|)\n",
+         max_err, max_ref > 0 ? max_err / max_ref : 0., rms_err,
+         rms_ref > 0 ? rms_err / rms_ref : 0.);
+}
+
+
+void MD::readState(cl_float4 *pos, cl_float4 *col) {
+  try {
+    err = queue.enqueueReadBuffer(cl_pos, CL_FALSE, 0, array_size, pos);
+    err = queue.enqueueReadBuffer(cl_col, CL_TRUE, 0, array_size, col);
+  }
+  catch (cl::Error er) {
+    printf("ERROR: %s(%s)\n", er.what(), oclErrorString(er.err()));
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+void MD::recordProfile(int nsteps) {
+  // Sum the device time of every command in each phase, per step of the
+  // batch. Acquire and release happen once per batch.
+  std::vector<double> batch(NUM_PHASES, -1.);
+  std::vector<std::vector<double> > steps(NUM_PHASES,
+                                          std::vector<double>(nsteps, 0.));
+  std::vector<bool> seen(NUM_PHASES, false);
+  try {
+    for (size_t i = 0; i < timed_events.size(); i++) {
+      const timed_event &t = timed_events[i];
+      cl_ulong start = t.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+      cl_ulong end = t.event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+      double ms = (end - start) * 1e-6;
+      if (t.step < 0) {
+        batch[t.phase] = std::max(batch[t.phase], 0.) + ms;
+      } else if (t.step < nsteps) {
+        steps[t.phase][t.step] += ms;
+        seen[t.phase] = true;
+      }
+    }
+  }
+  catch (cl::Error er) {
+    printf("ERROR: %s(%s)\n", er.what(), oclErrorString(er.err()));
+  }
+  timed_events.clear();
+
+  // Steps without samples or frames count as 0 in the observe phase, so
+  // each phase has one sample per step and slow steps stand out in p99.
+  seen[PHASE_OBSERVE] = seen[PHASE_OBSERVE] || observe_every > 0 || traj;
+  for (int i = 0; i < NUM_PHASES; i++) {
+    if (batch[i] >= 0)
+      profile.record(phase_ids[i], batch[i]);
+    if (seen[i])
+      for (int s = 0; s < nsteps; s++)
+        profile.record(phase_ids[i], steps[i][s]);
+  }
+}
+
+
+void MD::runKernel(int nsteps) {
   // This will update our system by calculating new velocity and updating the
-  // positions of our particles.
-  // Make sure OpenGL is done using our VBOs.
-  glFinish();
-  // Map OpenGL buffer object for writing from OpenCL.
-  // This passes in the vector of VBO buffer objects (position and color).
-  err = queue.enqueueAcquireGLObjects(&cl_vbos, NULL, &event);
-  //printf("acquire: %s\n", oclErrorString(err));
-  queue.finish();
+  // positions of our particles. The queue is in order, so the steps of a
+  // batch can be enqueued back to back and only waited on once at the end.
+  if (!headless) {
+    // Make sure OpenGL is done using our VBOs.
+    glFinish();
+    // Map OpenGL buffer object for writing from OpenCL.
+    // This passes in the vector of VBO buffer objects (position and color).
+    cl::Event ev;
+    err = queue.enqueueAcquireGLObjects(&cl_vbos, NULL, &ev);
+    //printf("acquire: %s\n", oclErrorString(err));
+    addTimedEvent(PHASE_ACQUIRE, -1, ev);
+  }
+
+  // Execute the kernel. The first step carries Verlet's initial forces.
+  batch_step = 0;
+  try {
+    if (verlet && !have_forces) {
+      enqueueNeighbors();
+      enqueueForce(forceKernel, splitSumKernel);
+      have_forces = true;
+    }
+    for (int step = 0; step < nsteps; step++) {
+      batch_step = step;
+      if (verlet) {
+        enqueueKernel(kickKernel, cl::NDRange(num), cl::NullRange,
+                      PHASE_UPDATE);
+        enqueueKernel(driftKernel, cl::NDRange(num), cl::NullRange,
+                      PHASE_UPDATE);
+      }
+      enqueueNeighbors();
+      bool observe = observeStep();
+      if (observe)
+        enqueueForce(observeForceKernel, observeSplitSumKernel);
+      else
+        enqueueForce(forceKernel, splitSumKernel);
+      enqueueKernel(verlet ? kickKernel : updateKernel, cl::NDRange(num),
+                    cl::NullRange, PHASE_UPDATE);
+      enqueueThermostat();
+      if (observe)
+        enqueueObserve();
+      if (traj && step_count % traj_every == 0)
+        enqueueTrajectory();
+    }
 
-  // Execute the kernel.
-  try {
-    err = queue.enqueueNDRangeKernel(forceKernel, cl::NullRange,
-                                     cl::NDRange(num),
-                                     cl::NDRange(group_size), NULL, &event);
-    //err = queue.enqueueNDRangeKernel(forceKernel, cl::NullRange,
-    //                                 cl::NDRange(num),
-    //                                   cl::NullRange, NULL, &event);
-    err = queue.enqueueNDRangeKernel(updateKernel, cl::NullRange,
-                                     cl::NDRange(num), cl::NullRange, NULL,
-                                     &event);
+    if (!headless) {
+      // Release the VBOs so OpenGL can play with them.
+      cl::Event ev;
+      err = queue.enqueueReleaseGLObjects(&cl_vbos, NULL, &ev);
+      addTimedEvent(PHASE_RELEASE, -1, ev);
+    }
+    if (use_cells)
+      err = queue.enqueueReadBuffer(cl_overflow, CL_FALSE, 0,
+                                    sizeof(overflow_host), overflow_host);
     err = queue.finish();
+    growNeighbors();
   }
   catch (cl::Error er) {
     printf("ERROR: %s(%s)\n", er.what(), oclErrorString(er.err()));
-    if (er.err() == -54)
-      std::cout << "The group size must evenly divide the number of particles."
-                << std::endl;
     exit(EXIT_FAILURE);
   }
 
-  // Release the VBOs so OpenGL can play with them.
-  err = queue.enqueueReleaseGLObjects(&cl_vbos, NULL, &event);
-  queue.finish();
+  // Everything has landed now, oldest sample first.
+  for (int k = 0; k < OBSERVE_RING; k++) {
+    int slot = (obs_next + k) % OBSERVE_RING;
+    if (obs_slots[slot].pending)
+      collectObservables(slot);
+  }
+  for (int k = 0; k < TRAJ_STAGING; k++) {
+    int slot = (traj_next + k) % TRAJ_STAGING;
+    if (traj_slots[slot].pending)
+      handTrajectory(slot);
+  }
+  recordProfile(nsteps);
 }
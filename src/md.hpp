@@ -4,48 +4,262 @@
 #define __CL_ENABLE_EXCEPTIONS
 #include "CL/cl.hpp"
 
+#include "engine.hpp"
 
-class MD {
+// Work-group size of the temperature reduction, REDUCE_SIZE in md.cl.
+#define REDUCE_SIZE 128
+// Observable samples that can be in flight to the host at once.
+#define OBSERVE_RING 8
+// Trajectory frames that can be in flight to the host at once.
+#define TRAJ_STAGING 2
+
+
+// The OpenCL engine.
+class MD : public Engine {
 public:
   // These are arrays used by the GPU.
   std::vector<cl::Memory> cl_vbos;  // 0: position vbo, 1: color vbo.
+  cl::Buffer cl_pos;  // Headless storage behind cl_vbos[0].
+  cl::Buffer cl_col;  // Headless storage behind cl_vbos[1].
   cl::Buffer cl_forces;
   cl::Buffer cl_vel;
+  cl::Buffer cl_neighbors;        // Verlet list, nlist_cap per particle.
+  cl::Buffer cl_neighbor_count;   // Length of each particle's list.
+  cl::Buffer cl_pos_ref;          // Positions when the list was last built.
+  cl::Buffer cl_rebuild;          // Set on the device when a rebuild is due.
+  cl::Buffer cl_cells;       // Particle indices binned by cell, cell_cap each.
+  cl::Buffer cl_cell_count;  // Number of particles in each cell.
+  cl::Buffer cl_overflow;    // Largest cell count and list that did not fit.
+  cl::Buffer cl_ke_partial;  // Sum of v^2 over each reduction group.
+  cl::Buffer cl_thermo;      // Temperature, velocity scale, NH friction.
+  cl::Buffer cl_observe;       // Per-particle potential energy and virial.
+  cl::Buffer cl_obs_partial;   // Observable sums over each reduction group.
+  cl::Buffer cl_obs_totals;    // Kinetic, potential energy and virial.
+  cl::Buffer cl_obs_pinned;    // Host-mapped ring the totals are read into.
+  cl::Buffer cl_pos_buffer;    // cl_vbos[0] as a buffer, for reading back.
+  cl::Buffer cl_traj_pinned;   // Host-mapped trajectory staging frames.
+  cl::Buffer cl_traj_delta;    // Grid steps since the last compressed frame.
+  cl::Buffer cl_traj_grid[TRAJ_STAGING];  // Grid coordinates of the frames.
+  cl::Buffer cl_split_partial; // Force (and observable) slices of force_split.
 
-  GLuint pos_vbo;     // Position vbo.
-  GLuint col_vbo;     // Colors vbo.
-  int num;            // The number of particles.
   size_t array_size;  // The size of our arrays num * sizeof(cl_float4).
+  float cutoff;       // Interaction cutoff used by the clipped kernels.
+  float skin;         // Extra neighbor list radius beyond the cutoff.
+  bool program_cache; // Reuse program binaries from previous runs.
+  bool fast_math;     // Build with -cl-fast-relaxed-math -cl-mad-enable.
+  int iblock;         // Particles per work-item in force_block, IBLOCK.
+  int jsplit;         // Slices per particle in force_split, 0 for automatic.
 
   // Default constructor initializes OpenCL context and automatically chooses
-  // platform and device.
-  MD();
+  // platform and device. A headless instance uses a plain context and
+  // ordinary buffers, so no GL context is needed.
+  MD(bool headless_val = false);
   // Default destructor. Currently does nothing because the program ends.
   ~MD();
 
   std::string loadFile(const char *filename);
-  // Load an OpenCL program from a string.
-  void loadProgram(std::string kernel_source, int group_size_val);
-  void loadData(std::vector<cl_float4> pos, std::vector<cl_float4> force,
-                std::vector<cl_float4> vel, std::vector<cl_float4> col);
-  void clInit(float bound, float dt, std::string force_kernel_name);
-  // Execute the kernel.
-  void runKernel();
+  // Load an OpenCL program from a string. The physical constants and the
+  // particle count are compiled in, so this must follow loadData.
+  void loadProgram(std::string kernel_source, int group_size_val,
+                   const sim_params &params);
+  // Time each force kernel that computes the same forces as
+  // params.force_kernel_name at each group size the device allows, and
+  // return the fastest pair. Results are cached per device, particle count,
+  // density and cutoff. Call between loadProgram and init.
+  void autotune(const sim_params &params, std::string *kernel_name,
+                int *group_size_out);
+  void loadData(const std::vector<cl_float4> &pos,
+                const std::vector<cl_float4> &force,
+                const std::vector<cl_float4> &vel,
+                const std::vector<cl_float4> &col);
+  void clInit(float bound, std::string force_kernel_name, float skin_val);
+  void init(const sim_params &params);
+  // Execute the kernels for nsteps steps in one GL acquire/release cycle.
+  void runKernel(int nsteps = 1);
+  void readState(cl_float4 *pos, cl_float4 *col);
+  void readVelocities(cl_float4 *vel);
+  float temperature();
+  void takeObservables(std::vector<observables> *out);
+  void setTrajectory(TrajectoryWriter *writer, int every);
+  void saveState(engine_state *out);
+  void restoreState(const engine_state &in);
+  // Compare the forces of our force kernel with those of the same kernel in
+  // a build without LJ_FAST and fast-math, and print the max and RMS error.
+  void validate();
 
 private:
 
+  bool headless;
   unsigned int deviceUsed;
   std::vector<cl::Device> devices;
 
   cl::Context context;
   cl::CommandQueue queue;
   cl::Program program;
+  std::string program_source;
+  std::string reference_options;  // Build options without any fast paths.
+  std::string force_kernel_base;  // Force kernel name without _fast.
   cl::Kernel kernel;
   cl::Kernel forceKernel;
   cl::Kernel updateKernel;
+  cl::Kernel kickKernel;
+  cl::Kernel driftKernel;
+  cl::Kernel cellClearKernel;
+  cl::Kernel cellBinKernel;
+  cl::Kernel nlistCheckKernel;
+  cl::Kernel nlistBuildKernel;
+  cl::Kernel nlistResetKernel;
+  cl::Kernel keReduceKernel;
+  cl::Kernel keFinishKernel;
+  cl::Kernel thermostatKernel;
+  cl::Program observe_program;  // Built with -D OBSERVE, if sampling.
+  cl::Kernel observeForceKernel;
+  cl::Kernel observeReduceKernel;
+  cl::Kernel observeFinishKernel;
+  cl::Kernel quantizeKernel;
+  cl::Kernel splitSumKernel;
+  cl::Kernel observeSplitSumKernel;
 
   int group_size;
 
+  // Velocity Verlet instead of the Euler update. It needs the forces at the
+  // start of the first step, computed on the first runKernel.
+  bool verlet;
+  bool have_forces;
+  bool pbc;  // Built with -D PBC.
+
+  // Thermostat, applied on the device after each step. The temperature is
+  // reduced on the device too, and only read back every thermo_every steps.
+  int thermostat;
+  int thermo_every;
+  int num_partial;       // Reduction groups over the particles.
+  cl_uint step_count;    // Steps so far, seeds the Langevin noise.
+  cl_float4 thermo_host; // Last cl_thermo read back.
+  void thermoInit(const sim_params &params);
+  // Enqueue the end-of-step temperature reduction and thermostat, if due.
+  void enqueueThermostat();
+
+  // Observables, every observe_every steps. Those steps use the force
+  // kernel of the OBSERVE build, whose per-particle energies and virials are
+  // reduced on the device. Only the three totals are copied back, without
+  // blocking, into the next slot of a ring of pinned host memory.
+  int observe_every;
+  float bound;
+  cl_float4 *obs_ring;  // OBSERVE_RING totals, mapped from cl_obs_pinned.
+  struct obs_slot {
+    int step;
+    bool pending;       // A copy into this slot has been enqueued.
+    cl::Event event;
+  };
+  obs_slot obs_slots[OBSERVE_RING];
+  int obs_next;         // Next slot to fill, also the oldest pending one.
+  std::vector<observables> obs_samples;
+  void observeInit();
+  bool observeStep() const;
+  void enqueueObserve();
+  // Wait for a slot's copy and convert it into a sample.
+  void collectObservables(int slot);
+
+  // Trajectory frames are read back without blocking into pinned staging
+  // memory, then passed on to the writer thread once they have landed.
+  // Compressed frames are quantized first, and only each particle's grid
+  // steps since the previous frame cross the bus, one word per particle.
+  // The first frame, and any with a step too large for a word, read the
+  // full grid coordinates instead.
+  TrajectoryWriter *traj;
+  int traj_every;
+  cl_float4 *traj_ring;  // TRAJ_STAGING frames of num positions, then num
+                         // velocities.
+  struct traj_slot {
+    int step;
+    bool pending;
+    bool absolute;       // Holds grid coordinates rather than steps.
+    cl::Event event;
+  };
+  std::vector<int32_t> traj_grid;  // Last handed frame's grid coordinates.
+  bool traj_have_grid;   // Whether the device's last frame follows on it.
+  traj_slot traj_slots[TRAJ_STAGING];
+  int traj_next;
+  void enqueueTrajectory();
+  void handTrajectory(int slot);
+
+  // Build a program, going through the binary cache. Exits on failure.
+  cl::Program buildProgram(const std::string &kernel_source,
+                           const std::string &options);
+  // Point a force kernel at the particle data and our neighbor structures.
+  void setForceArgs(cl::Kernel &kernel, cl::Buffer &forces);
+  // The split kernels spread each particle's partners over nsplit work-items
+  // and add up their partial forces in a second pass, for systems too small
+  // to fill the device one particle per work-item.
+  bool use_split;
+  int nsplit;
+  // Choose nsplit and size the partial buffer, if the force kernel is split.
+  void splitInit();
+  // A force_split_sum kernel from prog that adds the slices into forces.
+  cl::Kernel makeSplitSum(cl::Program &prog, cl::Buffer &forces);
+  // Mean device time (ms) of a step's neighbor upkeep and force with the
+  // given kernel and group size, or a negative number if it fails to run.
+  double timeForce(const std::string &kernel_base, int g, float bound);
+
+  // Uniform grid used by force_cell, rebuilt on the device every step.
+  bool use_cells;
+  int num_cells;
+  int cell_cap;
+  cl_int4 cell_dims;
+  float cell_size;
+
+  // Verlet neighbor list used by force_nlist, only rebuilt once some
+  // particle has moved more than skin/2.
+  bool use_nlist;
+  int nlist_cap;
+
+  // The kernels fall back to scanning every particle where a cell or
+  // neighbor list has overflowed, so the forces stay right. The overflow is
+  // read back at the end of each batch and the cells and lists grown for the
+  // next one.
+  cl_int overflow_host[2];
+
+  // Size the grid for the box and create the binning kernels. Cells are at
+  // least radius wide.
+  void cellInit(float bound, float radius);
+  void nlistInit(float bound);
+  // Grow the cells and lists to fit the overflow seen in the last batch, if
+  // any.
+  void growNeighbors();
+
+  // Device timing of each phase of a step, from the queue's profiling info.
+  enum phase {
+    PHASE_ACQUIRE,
+    PHASE_NEIGHBOR,  // Cell binning and neighbor list upkeep.
+    PHASE_FORCE,
+    PHASE_UPDATE,
+    PHASE_OBSERVE,   // Observable reductions and trajectory packing.
+    PHASE_RELEASE,
+    NUM_PHASES
+  };
+  int phase_ids[NUM_PHASES];
+  struct timed_event {
+    int phase;
+    int step;       // Step of the batch, or -1 for acquire and release.
+    cl::Event event;
+  };
+  std::vector<timed_event> timed_events;
+  int batch_step;   // Step being enqueued, for the events of enqueueKernel.
+  void addTimedEvent(int phase, int step, const cl::Event &ev);
+
+  // Global size of the force kernels, num (or for force_block, num / IBLOCK)
+  // rounded up to whole groups. The kernels skip the work-items past num.
+  cl::NDRange forceRange() const;
+  void enqueueKernel(cl::Kernel &kernel, const cl::NDRange &global,
+                     const cl::NDRange &local, int phase);
+  // Enqueue one force evaluation, followed by sum for the split kernels.
+  void enqueueForce(cl::Kernel &force, cl::Kernel &sum);
+  // Bring the cell grid and neighbor lists up to date, if used.
+  void enqueueNeighbors();
+  // Fold the timings of the finished commands into the profile, one sample
+  // per step of the batch (per batch for acquire and release).
+  void recordProfile(int nsteps);
+
   // Debugging variables.
   cl_int err;
   /// cl_event event;
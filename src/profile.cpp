@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <algorithm>
+
+#include "profile.hpp"
+
+
+Profile::Profile(int window_val) {
+  window = window_val;
+}
+
+
+int Profile::addPhase(const std::string &name) {
+  phase_samples p;
+  p.name = name;
+  p.next = 0;
+  phases.push_back(p);
+  return phases.size() - 1;
+}
+
+
+void Profile::record(int phase, double ms) {
+  phase_samples &p = phases[phase];
+  if ((int)p.samples.size() < window) {
+    p.samples.push_back(ms);
+  } else {
+    p.samples[p.next] = ms;
+    p.next = (p.next + 1) % window;
+  }
+}
+
+
+double Profile::min(int phase) const {
+  const std::vector<double> &s = phases[phase].samples;
+  return s.empty() ? 0 : *std::min_element(s.begin(), s.end());
+}
+
+
+double Profile::mean(int phase) const {
+  const std::vector<double> &s = phases[phase].samples;
+  if (s.empty())
+    return 0;
+  double sum = 0;
+  for (size_t i = 0; i < s.size(); i++)
+    sum += s[i];
+  return sum / s.size();
+}
+
+
+double Profile::p99(int phase) const {
+  std::vector<double> s = phases[phase].samples;
+  if (s.empty())
+    return 0;
+  size_t k = (s.size() * 99) / 100;
+  if (k >= s.size())
+    k = s.size() - 1;
+  std::nth_element(s.begin(), s.begin() + k, s.end());
+  return s[k];
+}
+
+
+std::string Profile::summary() const {
+  std::string out;
+  char buf[128];
+  for (size_t i = 0; i < phases.size(); i++) {
+    if (phases[i].samples.empty())
+      continue;
+    snprintf(buf, sizeof(buf), "%s%s %.3f/%.3f/%.3f", out.empty() ? "" : ", ",
+             phases[i].name.c_str(), min(i), mean(i), p99(i));
+    out += buf;
+  }
+  if (!out.empty())
+    out = "ms min/mean/p99: " + out;
+  return out;
+}
@@ -0,0 +1,35 @@
+#ifndef MD_PROFILE_H_INCLUDED
+#define MD_PROFILE_H_INCLUDED
+
+#include <string>
+#include <vector>
+
+
+// Rolling timing statistics for the phases of a step. Each phase keeps its
+// last `window` samples, in milliseconds.
+class Profile {
+public:
+  Profile(int window_val = 512);
+
+  // Register a phase and return its id for record().
+  int addPhase(const std::string &name);
+  void record(int phase, double ms);
+
+  double min(int phase) const;
+  double mean(int phase) const;
+  double p99(int phase) const;
+
+  // One "name min/mean/p99" entry per phase with samples, e.g. for the HUD.
+  std::string summary() const;
+
+private:
+  struct phase_samples {
+    std::string name;
+    std::vector<double> samples;  // Ring buffer of the last window samples.
+    int next;
+  };
+  std::vector<phase_samples> phases;
+  int window;
+};
+
+#endif
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fstream>
+
+
+#include "program_cache.hpp"
+
+
+namespace {
+
+// 64-bit FNV-1a, continued from h.
+unsigned long long fnv1a(const std::string &s, unsigned long long h) {
+  for (size_t i = 0; i < s.size(); i++) {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+
+std::string cacheDir() {
+  const char *dir = getenv("MD_CACHE_DIR");
+  if (dir && *dir)
+    return dir;
+  dir = getenv("XDG_CACHE_HOME");
+  if (dir && *dir)
+    return std::string(dir) + "/md";
+  dir = getenv("HOME");
+  return std::string(dir ? dir : ".") + "/.cache/md";
+}
+
+
+// mkdir -p.
+bool makeDirs(const std::string &path) {
+  for (size_t i = 1; i <= path.size(); i++) {
+    if (i < path.size() && path[i] != '/')
+      continue;
+    std::string part = path.substr(0, i);
+    if (mkdir(part.c_str(), 0755) != 0 && errno != EEXIST)
+      return false;
+  }
+  return true;
+}
+
+
+// Write path under a temporary name and rename it into place.
+bool replaceFile(const std::string &path, const char *data, size_t size) {
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%d.tmp", (int)getpid());
+  std::string tmp = path + suffix;
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (!f) {
+    perror(tmp.c_str());
+    return false;
+  }
+  bool ok = fwrite(data, 1, size, f) == size;
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+    perror(path.c_str());
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+}
+
+
+std::string programCachePath(const std::string &source,
+                             const std::string &device,
+                             const std::string &options) {
+  // Hash each part with a separator so the parts cannot run into each other.
+  unsigned long long h = 14695981039346656037ULL;
+  h = fnv1a(source, h);
+  h = fnv1a(std::string(1, '\0') + device, h);
+  h = fnv1a(std::string(1, '\0') + options, h);
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.bin", h);
+  return cacheDir() + "/" + name;
+}
+
+
+bool programCacheLoad(const std::string &path, std::vector<char> *binary) {
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f)
+    return false;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  bool ok = size > 0;
+  if (ok) {
+    binary->resize(size);
+    ok = fread(&(*binary)[0], 1, size, f) == (size_t)size;
+  }
+  fclose(f);
+  return ok;
+}
+
+
+void programCacheStore(const std::string &path,
+                       const std::vector<char> &binary) {
+  if (binary.empty())
+    return;
+  std::string dir = path.substr(0, path.rfind('/'));
+  if (!makeDirs(dir)) {
+    perror(dir.c_str());
+    return;
+  }
+
+  replaceFile(path, &binary[0], binary.size());
+}
+
+
+bool tuningCacheLoad(const std::string &key, std::string *value) {
+  std::ifstream in((cacheDir() + "/autotune").c_str());
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.compare(0, key.size() + 1, key + "\t") == 0) {
+      *value = line.substr(key.size() + 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+
+void tuningCacheStore(const std::string &key, const std::string &value) {
+  std::string dir = cacheDir();
+  if (!makeDirs(dir)) {
+    perror(dir.c_str());
+    return;
+  }
+  // Keep the other keys' results. Concurrent stores may lose one of the
+  // new results, but never leave a partial file.
+  std::string path = dir + "/autotune";
+  std::ifstream in(path.c_str());
+  std::string line, out;
+  while (std::getline(in, line))
+    if (line.compare(0, key.size() + 1, key + "\t") != 0)
+      out += line + "\n";
+  out += key + "\t" + value + "\n";
+  replaceFile(path, out.data(), out.size());
+}
@@ -0,0 +1,33 @@
+#ifndef MD_PROGRAM_CACHE_H_INCLUDED
+#define MD_PROGRAM_CACHE_H_INCLUDED
+
+#include <string>
+#include <vector>
+
+
+// On-disk cache of built OpenCL program binaries, so a program is only
+// compiled from source once per source, device, driver and build options,
+// and of autotuning results. Files live in $MD_CACHE_DIR, else
+// $XDG_CACHE_HOME/md, else ~/.cache/md.
+
+// Cache file for a program. device should identify the device and driver,
+// e.g. its name, vendor, version and driver version.
+std::string programCachePath(const std::string &source,
+                             const std::string &device,
+                             const std::string &options);
+
+// Read a cached binary. Returns false if there is none.
+bool programCacheLoad(const std::string &path, std::vector<char> *binary);
+
+// Store a binary. The file is written under a temporary name and renamed, so
+// concurrent runs never see a partial file. Failures are only reported.
+void programCacheStore(const std::string &path,
+                       const std::vector<char> &binary);
+
+// Autotuning results, one "key<TAB>value" line per key in the file
+// "autotune". Neither may contain tabs or newlines. Load returns false if
+// key has no result; Store replaces any previous one.
+bool tuningCacheLoad(const std::string &key, std::string *value);
+void tuningCacheStore(const std::string &key, const std::string &value);
+
+#endif
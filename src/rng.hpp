@@ -0,0 +1,19 @@
+#ifndef MD_RNG_H_INCLUDED
+#define MD_RNG_H_INCLUDED
+
+
+// Counter-based random numbers, the same as in md.cl: a PCG hash of
+// (seed, step, particle), so the noise needs no per-particle state.
+static inline unsigned int pcg_hash(unsigned int x) {
+  unsigned int state = x * 747796405u + 2891336453u;
+  unsigned int word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+  return (word >> 22u) ^ word;
+}
+
+
+// Uniform in (0, 1).
+static inline float pcg_uniform(unsigned int h) {
+  return ((h >> 8) + 0.5f) * (1.f / 16777216.f);
+}
+
+#endif
@@ -0,0 +1,42 @@
+#include <algorithm>
+
+#include "snapshot.hpp"
+
+
+Snapshot::Snapshot(int num) {
+  for (int i = 0; i < 3; i++) {
+    slots[i].pos.resize(num);
+    slots[i].col.resize(num);
+    slots[i].step = 0;
+  }
+  back_slot = 0;
+  ready_slot = 1;
+  front_slot = 2;
+  fresh = false;
+  pthread_mutex_init(&mutex, NULL);
+}
+
+
+Snapshot::~Snapshot() {
+  pthread_mutex_destroy(&mutex);
+}
+
+
+void Snapshot::publish() {
+  pthread_mutex_lock(&mutex);
+  std::swap(back_slot, ready_slot);
+  fresh = true;
+  pthread_mutex_unlock(&mutex);
+}
+
+
+bool Snapshot::acquire() {
+  pthread_mutex_lock(&mutex);
+  bool was_fresh = fresh;
+  if (fresh) {
+    std::swap(front_slot, ready_slot);
+    fresh = false;
+  }
+  pthread_mutex_unlock(&mutex);
+  return was_fresh;
+}
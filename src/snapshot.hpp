@@ -0,0 +1,45 @@
+#ifndef MD_SNAPSHOT_H_INCLUDED
+#define MD_SNAPSHOT_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include <CL/cl_platform.h>
+
+
+// Hands particle positions and colors from the simulation thread to the
+// renderer. Three slots are used: the writer fills the back slot while the
+// reader holds the front one, and publishing only swaps indices, so neither
+// side ever waits on the other's copy.
+class Snapshot {
+public:
+  struct frame {
+    std::vector<cl_float4> pos;
+    std::vector<cl_float4> col;
+    std::string stats;  // Profile summary at the time of the snapshot.
+    int step;           // Steps run when the snapshot was taken.
+  };
+
+  Snapshot(int num);
+  ~Snapshot();
+
+  // Writer side. Fill back() and publish() it as the newest snapshot.
+  frame &back() { return slots[back_slot]; }
+  void publish();
+
+  // Reader side. Returns true and moves front() to the newest snapshot if
+  // one was published since the last call.
+  bool acquire();
+  const frame &front() const { return slots[front_slot]; }
+
+private:
+  frame slots[3];
+  int back_slot;
+  int ready_slot;  // Newest published snapshot, swapped under the mutex.
+  int front_slot;
+  bool fresh;      // ready_slot has not been acquired yet.
+  pthread_mutex_t mutex;
+};
+
+#endif
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+
+#include "thread_pool.hpp"
+
+
+namespace {
+
+struct worker_arg {
+  ThreadPool *pool;
+  int tid;
+};
+
+}
+
+
+ThreadPool::ThreadPool(int nthreads_val) {
+  nthreads = nthreads_val;
+  if (nthreads <= 0)
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads <= 0)
+    nthreads = 1;
+
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&start_cond, NULL);
+  pthread_cond_init(&done_cond, NULL);
+  task = NULL;
+  generation = 0;
+  pending = 0;
+  stop = false;
+
+  // Thread 0 is the caller of run().
+  threads.resize(nthreads - 1);
+  for (int i = 1; i < nthreads; i++) {
+    worker_arg *arg = new worker_arg;
+    arg->pool = this;
+    arg->tid = i;
+    if (pthread_create(&threads[i - 1], NULL, worker, arg) != 0) {
+      printf("ERROR: could not start worker thread %d\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+
+ThreadPool::~ThreadPool() {
+  pthread_mutex_lock(&mutex);
+  stop = true;
+  pthread_cond_broadcast(&start_cond);
+  pthread_mutex_unlock(&mutex);
+
+  for (size_t i = 0; i < threads.size(); i++)
+    pthread_join(threads[i], NULL);
+
+  pthread_cond_destroy(&done_cond);
+  pthread_cond_destroy(&start_cond);
+  pthread_mutex_destroy(&mutex);
+}
+
+
+void ThreadPool::run(Task *t) {
+  pthread_mutex_lock(&mutex);
+  task = t;
+  pending = nthreads - 1;
+  generation++;
+  pthread_cond_broadcast(&start_cond);
+  pthread_mutex_unlock(&mutex);
+
+  t->run(0, nthreads);
+
+  pthread_mutex_lock(&mutex);
+  while (pending > 0)
+    pthread_cond_wait(&done_cond, &mutex);
+  task = NULL;
+  pthread_mutex_unlock(&mutex);
+}
+
+
+void ThreadPool::range(int n, int tid, int nthreads, int *begin, int *end) {
+  int chunk = n / nthreads;
+  int extra = n % nthreads;
+  *begin = tid * chunk + (tid < extra ? tid : extra);
+  *end = *begin + chunk + (tid < extra ? 1 : 0);
+}
+
+
+void *ThreadPool::worker(void *arg_ptr) {
+  worker_arg *arg = (worker_arg *)arg_ptr;
+  ThreadPool *pool = arg->pool;
+  int tid = arg->tid;
+  delete arg;
+
+  unsigned long seen = 0;
+  while (true) {
+    pthread_mutex_lock(&pool->mutex);
+    while (!pool->stop && pool->generation == seen)
+      pthread_cond_wait(&pool->start_cond, &pool->mutex);
+    if (pool->stop) {
+      pthread_mutex_unlock(&pool->mutex);
+      break;
+    }
+    seen = pool->generation;
+    Task *t = pool->task;
+    pthread_mutex_unlock(&pool->mutex);
+
+    t->run(tid, pool->nthreads);
+
+    pthread_mutex_lock(&pool->mutex);
+    if (--pool->pending == 0)
+      pthread_cond_signal(&pool->done_cond);
+    pthread_mutex_unlock(&pool->mutex);
+  }
+  return NULL;
+}
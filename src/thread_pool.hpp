@@ -0,0 +1,46 @@
+#ifndef MD_THREAD_POOL_H_INCLUDED
+#define MD_THREAD_POOL_H_INCLUDED
+
+#include <vector>
+#include <pthread.h>
+
+
+// A fixed set of worker threads that all run the same task together, in the
+// style of an OpenMP parallel region. The calling thread takes part as
+// thread 0, so a pool of size 1 has no workers at all.
+class ThreadPool {
+public:
+  class Task {
+  public:
+    virtual ~Task() {}
+    // Called once on each of the nthreads threads.
+    virtual void run(int tid, int nthreads) = 0;
+  };
+
+  // A size of 0 uses one thread per online processor.
+  ThreadPool(int nthreads = 0);
+  ~ThreadPool();
+
+  // Run task on every thread and wait for all of them to finish.
+  void run(Task *task);
+  int size() const { return nthreads; }
+
+  // Split [0, n) into nthreads contiguous chunks and return chunk tid.
+  static void range(int n, int tid, int nthreads, int *begin, int *end);
+
+private:
+  static void *worker(void *arg);
+
+  int nthreads;
+  std::vector<pthread_t> threads;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t start_cond;
+  pthread_cond_t done_cond;
+  Task *task;
+  unsigned long generation;  // Bumped for every task handed out.
+  int pending;               // Workers still running the current task.
+  bool stop;
+};
+
+#endif
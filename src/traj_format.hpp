@@ -0,0 +1,111 @@
+#ifndef MD_TRAJ_FORMAT_H_INCLUDED
+#define MD_TRAJ_FORMAT_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+
+
+// Binary trajectory file: a traj_header, then one frame per sample, each an
+// int32 step followed by num x, y, z float positions (Angstrom) and, with
+// TRAJ_VELOCITIES, num x, y, z float velocities (Meter/Second). All values
+// are in the byte order of the machine that wrote them.
+//
+// With TRAJ_COMPRESSED, positions are instead quantized to a grid of
+// `precision` Angstrom (see trajPack). Each frame is a traj_record followed
+// by `size` bytes of zlib data, which inflate to the zigzag varint
+// differences of the 3 * num grid coordinates from the previous frame's
+// (from zero in every `keyframe`-th frame, starting with the first), then
+// the float velocities. The file ends in the offset of every record and a
+// traj_index.
+#define TRAJ_MAGIC "MDTRAJ1"
+#define TRAJ_VERSION 2
+#define TRAJ_VELOCITIES 1  // Header flag.
+#define TRAJ_COMPRESSED 2  // Header flag.
+#define TRAJ_KEYFRAME 100  // Frames between keyframes when writing.
+#define TRAJ_MAX_BITS 21   // Largest grid, in bits per coordinate.
+#define TRAJ_INDEX_MAGIC "MDTRIDX"
+
+struct traj_header {
+  char magic[8];     // TRAJ_MAGIC, NUL terminated.
+  uint32_t version;  // TRAJ_VERSION.
+  uint32_t num;      // Particles per frame.
+  uint32_t flags;    // TRAJ_VELOCITIES.
+  uint32_t pbc;      // 1 if the box is periodic.
+  float bound;       // Box size (+-), Angstrom.
+  float dt;          // Time step, seconds.
+  float precision;   // Grid spacing with TRAJ_COMPRESSED, Angstrom.
+  uint32_t bits;     // Bits per grid coordinate.
+  uint32_t keyframe; // Frames from one keyframe to the next.
+  uint32_t reserved;
+};
+
+struct traj_record {
+  int32_t step;
+  uint32_t size;     // Bytes of zlib data that follow.
+};
+
+struct traj_index {
+  uint64_t offset;   // Of the frames uint64 record offsets, from the start.
+  uint64_t frames;
+  char magic[8];     // TRAJ_INDEX_MAGIC, NUL terminated.
+};
+
+
+// Words a particle's packed grid coordinates take.
+inline int trajWords(int bits) {
+  return 3 * bits <= 32 ? 1 : 2;
+}
+
+// Pack a particle's three grid coordinates into out, x in the lowest bits.
+inline void trajPackGrid(const int32_t *g, int bits, uint32_t *out) {
+  uint64_t q = 0;
+  for (int c = 0; c < 3; c++)
+    q |= (uint64_t)(uint32_t)g[c] << (c * bits);
+  out[0] = (uint32_t)q;
+  if (trajWords(bits) == 2)
+    out[1] = (uint32_t)(q >> 32);
+}
+
+// Put a position on the grid and pack its coordinates into out. The grid is
+// the same as the quantize kernel's in md.cl.
+inline void trajPack(float x, float y, float z, float bound,
+                     float inv_precision, int bits, uint32_t *out) {
+  float max_q = (float)((1u << bits) - 1);
+  float p[3] = {x, y, z};
+  int32_t g[3];
+  for (int c = 0; c < 3; c++) {
+    float v = rintf((p[c] + bound) * inv_precision);
+    g[c] = (int32_t)(v < 0 ? 0 : v > max_q ? max_q : v);
+  }
+  trajPackGrid(g, bits, out);
+}
+
+// The quantize kernel reads back each particle's move since the last frame
+// as one word: three signed TRAJ_DELTA_BITS-bit grid steps, x in the lowest
+// bits, or TRAJ_DELTA_ESCAPE if any of them does not fit.
+#define TRAJ_DELTA_BITS 10
+#define TRAJ_DELTA_ESCAPE 0x80000000u
+
+// Add a delta word's steps to g. Returns false for TRAJ_DELTA_ESCAPE.
+inline bool trajApplyDelta(uint32_t d, int32_t *g) {
+  if (d & TRAJ_DELTA_ESCAPE)
+    return false;
+  const uint32_t mask = (1u << TRAJ_DELTA_BITS) - 1;
+  const uint32_t sign = 1u << (TRAJ_DELTA_BITS - 1);
+  for (int c = 0; c < 3; c++) {
+    uint32_t v = (d >> (c * TRAJ_DELTA_BITS)) & mask;
+    g[c] += (int32_t)(v ^ sign) - (int32_t)sign;
+  }
+  return true;
+}
+
+// Inflate a compressed frame's data. q holds the previous frame's grid
+// coordinates (3 * num), or zeros for a keyframe, and receives this frame's.
+// vel receives 3 * num velocities if not NULL and the file has them.
+// Returns false if the data is corrupt.
+bool trajDecode(const traj_header &h, const unsigned char *data, size_t size,
+                std::vector<int32_t> *q, float *vel);
+
+#endif
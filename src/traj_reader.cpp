@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+
+#include "traj_reader.hpp"
+
+
+// No frame.
+#define NONE ((size_t)-1)
+
+
+TrajectoryReader::TrajectoryReader() {
+  data = NULL;
+  size = 0;
+  num_frames = 0;
+  frame_size = 0;
+  decoded = last = NONE;
+  advised = 0;
+  memset(&h, 0, sizeof(h));
+}
+
+
+TrajectoryReader::~TrajectoryReader() {
+  close();
+}
+
+
+bool TrajectoryReader::open(const std::string &path_val) {
+  close();
+  path = path_val;
+  int fd = ::open(path.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(path.c_str());
+    if (fd >= 0)
+      ::close(fd);
+    return false;
+  }
+  size = st.st_size;
+  if (size < sizeof(h)) {
+    printf("ERROR: %s is not a trajectory file\n", path.c_str());
+    ::close(fd);
+    return false;
+  }
+  void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED) {
+    perror(path.c_str());
+    return false;
+  }
+  data = (const char *)map;
+  // Only what is asked for; access() prefetches for scans.
+  madvise(map, size, MADV_RANDOM);
+
+  memcpy(&h, data, sizeof(h));
+  if (strncmp(h.magic, TRAJ_MAGIC, sizeof(h.magic)) != 0 ||
+      h.version != TRAJ_VERSION || h.num == 0 ||
+      (compressed() && (h.keyframe == 0 || h.bits == 0 ||
+                        h.bits > TRAJ_MAX_BITS))) {
+    printf("ERROR: %s is not a trajectory file\n", path.c_str());
+    close();
+    return false;
+  }
+
+  if (!compressed()) {
+    // A frame cut short by the end of a run does not count.
+    frame_size = sizeof(int32_t) +
+      (velocities() ? 2 : 1) * 3 * sizeof(float) * (size_t)h.num;
+    num_frames = (size - sizeof(h)) / frame_size;
+    return true;
+  }
+
+  traj_index index;
+  bool indexed = false;
+  if (size >= sizeof(h) + sizeof(index)) {
+    memcpy(&index, data + size - sizeof(index), sizeof(index));
+    size_t room = (size - sizeof(h) - sizeof(index)) / sizeof(uint64_t);
+    indexed =
+      strncmp(index.magic, TRAJ_INDEX_MAGIC, sizeof(index.magic)) == 0 &&
+      index.frames <= room && index.offset <= size &&
+      index.offset + index.frames * sizeof(uint64_t) + sizeof(index) == size;
+  }
+  if (indexed) {
+    offsets.resize(index.frames);
+    if (index.frames > 0)
+      memcpy(&offsets[0], data + index.offset,
+             index.frames * sizeof(uint64_t));
+    // Every record header must lie within the frames.
+    for (size_t k = 0; k < offsets.size() && indexed; k++)
+      indexed = offsets[k] >= sizeof(h) &&
+        offsets[k] <= index.offset - sizeof(traj_record);
+    if (!indexed)
+      offsets.clear();
+  }
+  if (!indexed) {
+    // No usable index, the run was cut short or the index is damaged. Walk
+    // the records. Even an empty frame deflates to a few bytes, so a zero
+    // size means we have run into the index.
+    traj_record r;
+    for (size_t off = sizeof(h); off + sizeof(r) <= size;
+         off += sizeof(r) + r.size) {
+      memcpy(&r, data + off, sizeof(r));
+      if (r.size == 0 || r.size > size - off - sizeof(r))
+        break;
+      offsets.push_back(off);
+    }
+  }
+  num_frames = offsets.size();
+  grid.resize(3 * (size_t)h.num);
+  return true;
+}
+
+
+void TrajectoryReader::close() {
+  if (data)
+    munmap((void *)data, size);
+  data = NULL;
+  size = 0;
+  num_frames = 0;
+  offsets.clear();
+  grid.clear();
+  decoded = last = NONE;
+  advised = 0;
+}
+
+
+const char *TrajectoryReader::record(size_t k) const {
+  if (compressed())
+    return data + offsets[k];
+  return data + sizeof(h) + k * frame_size;
+}
+
+
+int TrajectoryReader::step(size_t k) const {
+  int32_t s;
+  memcpy(&s, record(k), sizeof(s));
+  return s;
+}
+
+
+size_t TrajectoryReader::frameEnd(size_t k) const {
+  if (!compressed())
+    return frameBegin(k) + frame_size;
+  traj_record r;
+  memcpy(&r, record(k), sizeof(r));
+  return std::min(size, (size_t)offsets[k] + sizeof(r) + r.size);
+}
+
+
+void TrajectoryReader::access(size_t k) {
+  bool sequential = last != NONE && k == last + 1;
+  last = k;
+  size_t begin = record(k) - data;
+  if (!sequential || begin + TRAJ_READAHEAD / 2 < advised)
+    return;
+  // Keep TRAJ_READAHEAD bytes ahead, advising half a window at a time.
+  size_t page = getpagesize();
+  size_t from = std::max(advised, begin) & ~(page - 1);
+  size_t to = std::min(size, begin + TRAJ_READAHEAD);
+  if (to > from)
+    madvise((void *)(data + from), to - from, MADV_WILLNEED);
+  advised = to;
+}
+
+
+bool TrajectoryReader::view(size_t k, frame_view *out) {
+  if (compressed() || k >= num_frames)
+    return false;
+  access(k);
+  const char *frame = record(k);
+  out->step = step(k);
+  out->pos = (const float *)(frame + sizeof(int32_t));
+  out->vel = velocities() ? out->pos + 3 * (size_t)h.num : NULL;
+  return true;
+}
+
+
+bool TrajectoryReader::decode(size_t k, float *vel) {
+  // Continue from the frame before, or start over at the keyframe.
+  size_t from = k - k % h.keyframe;
+  if (decoded != NONE && decoded < k && decoded >= from) {
+    from = decoded + 1;
+  } else {
+    std::fill(grid.begin(), grid.end(), 0);
+  }
+  decoded = NONE;
+  for (size_t j = from; j <= k; j++) {
+    traj_record r;
+    bool ok = offsets[j] + sizeof(r) <= size;
+    if (ok) {
+      memcpy(&r, record(j), sizeof(r));
+      ok = r.size <= size - offsets[j] - sizeof(r);
+    }
+    const unsigned char *z = (const unsigned char *)record(j) + sizeof(r);
+    if (!ok || !trajDecode(h, z, r.size, &grid, j == k ? vel : NULL)) {
+      printf("ERROR: frame %zu of %s is corrupt\n", j, path.c_str());
+      return false;
+    }
+  }
+  decoded = k;
+  return true;
+}
+
+
+const std::vector<int32_t> *TrajectoryReader::gridAt(size_t k) {
+  if (!compressed() || k >= num_frames)
+    return NULL;
+  access(k);
+  return decode(k, NULL) ? &grid : NULL;
+}
+
+
+bool TrajectoryReader::read(size_t k, std::vector<float> *pos,
+                            std::vector<float> *vel) {
+  if (k >= num_frames)
+    return false;
+  size_t n = 3 * (size_t)h.num;
+  pos->resize(n);
+  if (vel)
+    vel->resize(velocities() ? n : 0);
+  float *v = vel && velocities() ? &(*vel)[0] : NULL;
+
+  if (!compressed()) {
+    frame_view f;
+    view(k, &f);
+    memcpy(&(*pos)[0], f.pos, n * sizeof(float));
+    if (v)
+      memcpy(v, f.vel, n * sizeof(float));
+    return true;
+  }
+
+  access(k);
+  if (!decode(k, v))
+    return false;
+  for (size_t i = 0; i < n; i++)
+    (*pos)[i] = grid[i] * h.precision - h.bound;
+  return true;
+}
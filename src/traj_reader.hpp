@@ -0,0 +1,78 @@
+#ifndef MD_TRAJ_READER_H_INCLUDED
+#define MD_TRAJ_READER_H_INCLUDED
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "traj_format.hpp"
+
+
+// Bytes of frames prefetched ahead of a sequential scan.
+#define TRAJ_READAHEAD (32 << 20)
+
+
+// Random access to a trajectory file (see traj_format.hpp) through a
+// read-only memory map, so any frame of a file far larger than memory can be
+// reached without reading the ones before it. Raw frames are found by
+// arithmetic and compressed ones through the file's index. Reading frames
+// in order prefetches the next TRAJ_READAHEAD bytes with madvise; other
+// accesses only fault in the pages they touch.
+class TrajectoryReader {
+public:
+  // A raw frame in place, valid until close().
+  struct frame_view {
+    int step;
+    const float *pos;  // x, y, z per particle, Angstrom.
+    const float *vel;  // Meter/Second, NULL without velocities.
+  };
+
+  TrajectoryReader();
+  ~TrajectoryReader();
+
+  // Map path and find its frames. Prints the reason and returns false on
+  // failure.
+  bool open(const std::string &path_val);
+  void close();
+
+  const traj_header &header() const { return h; }
+  int num() const { return h.num; }
+  bool velocities() const { return h.flags & TRAJ_VELOCITIES; }
+  bool compressed() const { return h.flags & TRAJ_COMPRESSED; }
+  size_t frames() const { return num_frames; }
+  int step(size_t k) const;
+  // Bytes [frameBegin, frameEnd) of the file hold frame k.
+  size_t frameBegin(size_t k) const { return record(k) - data; }
+  size_t frameEnd(size_t k) const;
+  // Grid coordinates of compressed frame k, valid until the next read.
+  // NULL if the frame is corrupt.
+  const std::vector<int32_t> *gridAt(size_t k);
+
+  // Frame k without copying. Raw files only.
+  bool view(size_t k, frame_view *out);
+  // Frame k as 3 * num positions and, if vel is not NULL and the file has
+  // them, velocities. Compressed frames are decoded from the previous one
+  // when read in order and from their keyframe otherwise. Returns false if
+  // the frame is corrupt.
+  bool read(size_t k, std::vector<float> *pos, std::vector<float> *vel);
+
+private:
+  const char *record(size_t k) const;
+  // Prefetch if k follows the last frame read.
+  void access(size_t k);
+  bool decode(size_t k, float *vel);
+
+  std::string path;
+  const char *data;  // The mapped file.
+  size_t size;
+  traj_header h;
+  size_t num_frames;
+  size_t frame_size;               // Of raw frames.
+  std::vector<uint64_t> offsets;   // Of compressed frame records.
+  std::vector<int32_t> grid;       // Grid coordinates of frame `decoded`.
+  size_t decoded;
+  size_t last;                     // Last frame read.
+  size_t advised;                  // End of the prefetched bytes.
+};
+
+#endif
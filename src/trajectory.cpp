@@ -0,0 +1,302 @@
+#include <stdlib.h>
+#include <algorithm>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+
+#include "trajectory.hpp"
+#include "traj_reader.hpp"
+
+
+namespace {
+
+// Grid coordinates are coded as their difference from the last frame's,
+// zigzag mapped so small negative numbers stay small, then as varints of
+// seven bits per byte.
+void putVarint(std::vector<unsigned char> *out, int32_t d) {
+  uint32_t z = ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+  while (z >= 0x80) {
+    out->push_back((unsigned char)(z | 0x80));
+    z >>= 7;
+  }
+  out->push_back((unsigned char)z);
+}
+
+
+bool getVarint(const unsigned char **p, const unsigned char *end,
+               int32_t *d) {
+  uint32_t z = 0;
+  for (int shift = 0; shift < 35 && *p < end; shift += 7) {
+    unsigned char b = *(*p)++;
+    z |= (uint32_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      *d = (int32_t)(z >> 1) ^ -(int32_t)(z & 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+}
+
+
+bool trajDecode(const traj_header &h, const unsigned char *data, size_t size,
+                std::vector<int32_t> *q, float *vel) {
+  size_t n = 3 * (size_t)h.num;
+  bool with_vel = h.flags & TRAJ_VELOCITIES;
+  // Five bytes is the longest varint.
+  std::vector<unsigned char> raw(5 * n + (with_vel ? n * sizeof(float) : 0));
+  uLongf raw_size = raw.size();
+  if (q->size() != n ||
+      uncompress(&raw[0], &raw_size, data, size) != Z_OK)
+    return false;
+  const unsigned char *p = &raw[0], *end = p + raw_size;
+  for (size_t k = 0; k < n; k++) {
+    int32_t d;
+    if (!getVarint(&p, end, &d))
+      return false;
+    (*q)[k] += d;
+  }
+  if (with_vel) {
+    if ((size_t)(end - p) != n * sizeof(float))
+      return false;
+    if (vel)
+      memcpy(vel, p, n * sizeof(float));
+  }
+  return true;
+}
+
+
+TrajectoryWriter::TrajectoryWriter(const std::string &path_val, int num_val,
+                                   bool velocities_val,
+                                   float bound, float dt, bool pbc,
+                                   float precision_val, int resume_step,
+                                   int depth) {
+  path = path_val;
+  num = num_val;
+  with_vel = velocities_val;
+  grid_precision = precision_val;
+  grid_bits = 0;
+  zbytes = 0;
+  if (compressed()) {
+    // Enough bits for every grid point across the box.
+    double points = ceil(2 * bound / grid_precision) + 1;
+    while (grid_bits <= TRAJ_MAX_BITS && (double)(1u << grid_bits) < points)
+      grid_bits++;
+    if (grid_bits > TRAJ_MAX_BITS) {
+      printf("ERROR: a trajectory precision of %g A needs more than %d bits "
+             "per coordinate for this box\n", grid_precision, TRAJ_MAX_BITS);
+      exit(EXIT_FAILURE);
+    }
+    prev.resize(3 * num);
+  }
+  failed = false;
+  head = tail = 0;
+  closing = false;
+  stalls = 0;
+
+  traj_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, TRAJ_MAGIC, sizeof(h.magic));
+  h.version = TRAJ_VERSION;
+  h.num = num;
+  h.flags = (with_vel ? TRAJ_VELOCITIES : 0) |
+    (compressed() ? TRAJ_COMPRESSED : 0);
+  h.pbc = pbc;
+  h.bound = bound;
+  h.dt = dt;
+  h.precision = grid_precision;
+  h.bits = grid_bits;
+  h.keyframe = TRAJ_KEYFRAME;
+  if (resume_step >= 0 && access(path.c_str(), F_OK) == 0) {
+    resume(h, resume_step);
+  } else {
+    file = fopen(path.c_str(), "wb");
+    if (!file || fwrite(&h, sizeof(h), 1, file) != 1) {
+      perror(path.c_str());
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  slots.resize(depth);
+  for (int i = 0; i < depth; i++) {
+    if (compressed())
+      slots[i].packed.resize(words() * num);
+    else
+      slots[i].pos.resize(3 * num);
+    if (with_vel)
+      slots[i].vel.resize(3 * num);
+  }
+  pthread_create(&thread, NULL, run, this);
+}
+
+
+void TrajectoryWriter::resume(const traj_header &h, int step) {
+  TrajectoryReader reader;
+  if (!reader.open(path))
+    exit(EXIT_FAILURE);
+  const traj_header &old = reader.header();
+  if (old.num != h.num || old.flags != h.flags || old.pbc != h.pbc ||
+      old.bound != h.bound || old.dt != h.dt ||
+      old.precision != h.precision || old.bits != h.bits ||
+      (compressed() && old.keyframe != h.keyframe)) {
+    printf("ERROR: %s was written with other settings, remove it or choose "
+           "another --traj\n", path.c_str());
+    exit(EXIT_FAILURE);
+  }
+
+  // Keep the frames up to the checkpoint, the restarted run writes the
+  // ones after it again.
+  size_t keep = 0;
+  while (keep < reader.frames() && reader.step(keep) <= step)
+    keep++;
+  size_t end = keep ? reader.frameEnd(keep - 1) : sizeof(h);
+  if (compressed()) {
+    for (size_t k = 0; k < keep; k++)
+      offsets.push_back(reader.frameBegin(k));
+    if (keep) {
+      const std::vector<int32_t> *grid = reader.gridAt(keep - 1);
+      if (!grid)
+        exit(EXIT_FAILURE);
+      prev = *grid;
+    }
+    zbytes = end - sizeof(h);
+  }
+  reader.close();
+
+  file = fopen(path.c_str(), "r+b");
+  if (!file || ftruncate(fileno(file), end) != 0 ||
+      fseeko(file, end, SEEK_SET) != 0) {
+    perror(path.c_str());
+    exit(EXIT_FAILURE);
+  }
+  printf("Trajectory: continuing %s after %zu frames\n", path.c_str(), keep);
+}
+
+
+TrajectoryWriter::~TrajectoryWriter() {
+  __sync_synchronize();
+  closing = true;
+  pthread_join(thread, NULL);
+  if (compressed() && !failed) {
+    traj_index index;
+    memset(&index, 0, sizeof(index));
+    index.offset = ftello(file);
+    index.frames = offsets.size();
+    memcpy(index.magic, TRAJ_INDEX_MAGIC, sizeof(index.magic));
+    if ((!offsets.empty() &&
+         fwrite(&offsets[0], sizeof(uint64_t), offsets.size(), file) !=
+         offsets.size()) || fwrite(&index, sizeof(index), 1, file) != 1) {
+      perror(path.c_str());
+      failed = true;
+    }
+    if (!offsets.empty())
+      printf("Trajectory: %.2f bytes per particle and frame in %s.\n",
+             (double)zbytes / offsets.size() / num, path.c_str());
+  }
+  if (fclose(file) != 0 && !failed)
+    perror(path.c_str());
+  if (stalls > 0)
+    printf("Trajectory: the simulation waited on %s %ld times.\n",
+           path.c_str(), stalls);
+}
+
+
+TrajectoryWriter::frame &TrajectoryWriter::begin() {
+  if (head - tail >= slots.size()) {
+    // Full: the disk is slower than the simulation.
+    stalls++;
+    while (head - tail >= slots.size())
+      usleep(100);
+  }
+  // The writer is done with this slot once tail has passed it.
+  __sync_synchronize();
+  return slots[head % slots.size()];
+}
+
+
+void TrajectoryWriter::commit() {
+  // Publish the frame's contents before the new head.
+  __sync_synchronize();
+  head = head + 1;
+}
+
+
+void *TrajectoryWriter::run(void *arg) {
+  TrajectoryWriter *w = (TrajectoryWriter *)arg;
+  for (;;) {
+    bool done = w->closing;
+    __sync_synchronize();
+    if (w->tail == w->head) {
+      if (done)
+        break;
+      usleep(500);
+      continue;
+    }
+    w->writeFrame(w->slots[w->tail % w->slots.size()]);
+    // Hand the slot back only after we are done reading it.
+    __sync_synchronize();
+    w->tail = w->tail + 1;
+  }
+  return NULL;
+}
+
+
+void TrajectoryWriter::writeFrame(const frame &f) {
+  if (failed)
+    return;
+  if (compressed()) {
+    writeCompressed(f);
+    return;
+  }
+  int32_t step = f.step;
+  bool ok = fwrite(&step, sizeof(step), 1, file) == 1 &&
+    fwrite(&f.pos[0], sizeof(float), f.pos.size(), file) == f.pos.size();
+  if (ok && with_vel)
+    ok = fwrite(&f.vel[0], sizeof(float), f.vel.size(), file) == f.vel.size();
+  if (!ok) {
+    perror(path.c_str());
+    failed = true;
+  }
+}
+
+
+void TrajectoryWriter::writeCompressed(const frame &f) {
+  if (offsets.size() % TRAJ_KEYFRAME == 0)
+    std::fill(prev.begin(), prev.end(), 0);
+  raw.clear();
+  int w = words();
+  uint32_t mask = (1u << grid_bits) - 1;
+  for (int i = 0; i < num; i++) {
+    const uint32_t *p = &f.packed[w * i];
+    uint64_t q = p[0] | (w == 2 ? (uint64_t)p[1] << 32 : 0);
+    for (int c = 0; c < 3; c++) {
+      int32_t v = (int32_t)((q >> (c * grid_bits)) & mask);
+      putVarint(&raw, v - prev[3 * i + c]);
+      prev[3 * i + c] = v;
+    }
+  }
+  if (with_vel) {
+    const unsigned char *v = (const unsigned char *)&f.vel[0];
+    raw.insert(raw.end(), v, v + f.vel.size() * sizeof(float));
+  }
+
+  // The fastest level: most of the gain is in the varints already, and the
+  // writer has to keep up with the simulation.
+  uLongf zsize = compressBound(raw.size());
+  zbuf.resize(zsize);
+  traj_record r;
+  r.step = f.step;
+  bool ok = compress2(&zbuf[0], &zsize, &raw[0], raw.size(),
+                      Z_BEST_SPEED) == Z_OK;
+  r.size = zsize;
+  offsets.push_back(ftello(file));
+  ok = ok && fwrite(&r, sizeof(r), 1, file) == 1 &&
+    fwrite(&zbuf[0], 1, zsize, file) == zsize;
+  if (!ok) {
+    perror(path.c_str());
+    failed = true;
+  }
+  zbytes += sizeof(r) + zsize;
+}
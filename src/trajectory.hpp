@@ -0,0 +1,79 @@
+#ifndef MD_TRAJECTORY_H_INCLUDED
+#define MD_TRAJECTORY_H_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include "traj_format.hpp"
+
+
+// Writes trajectory frames on a background thread. The simulation fills a
+// slot with begin() and hands it over with commit(); the slots form a
+// bounded single-producer, single-consumer ring indexed by two counters, so
+// neither side takes a lock. The simulation only waits if the writer has
+// fallen a whole ring behind.
+class TrajectoryWriter {
+public:
+  struct frame {
+    int step;
+    std::vector<float> pos;  // x, y, z per particle.
+    std::vector<float> vel;  // Only filled with velocities().
+    std::vector<uint32_t> packed;  // Instead of pos with compressed(),
+                                   // words() per particle.
+  };
+
+  // Create path and write the header for a box of +-bound Angstrom and a
+  // time step of dt seconds. A precision (Angstrom) above zero writes
+  // compressed frames. With a resume_step of zero or more an
+  // existing path is continued instead: its frames up to that step are kept
+  // and the rest cut off. Exits on failure or if the file was written with
+  // other settings.
+  TrajectoryWriter(const std::string &path, int num_val, bool velocities_val,
+                   float bound, float dt, bool pbc, float precision_val = 0,
+                   int resume_step = -1, int depth = 8);
+  // Write out the queued frames and the index and close the file.
+  ~TrajectoryWriter();
+
+  bool velocities() const { return with_vel; }
+  bool compressed() const { return grid_precision > 0; }
+  float precision() const { return grid_precision; }
+  int bits() const { return grid_bits; }
+  int words() const { return trajWords(grid_bits); }
+
+  // Producer side. The slot returned by begin() belongs to the caller until
+  // commit().
+  frame &begin();
+  void commit();
+
+private:
+  static void *run(void *arg);
+  void writeFrame(const frame &f);
+  void writeCompressed(const frame &f);
+  void resume(const traj_header &h, int step);
+
+  int num;
+  bool with_vel;
+  float grid_precision;
+  int grid_bits;
+  // Compression state, only touched by the writer thread.
+  std::vector<int32_t> prev;        // Last frame's grid coordinates.
+  std::vector<unsigned char> raw;   // Frame before deflating.
+  std::vector<unsigned char> zbuf;  // Frame after.
+  std::vector<uint64_t> offsets;    // Of each record, for the index.
+  uint64_t zbytes;                  // Record bytes written.
+  std::string path;
+  FILE *file;
+  bool failed;  // Stop writing after an I/O error, but keep draining.
+
+  std::vector<frame> slots;
+  volatile unsigned int head;  // Frames committed, advanced by the producer.
+  volatile unsigned int tail;  // Frames written, advanced by the writer.
+  volatile bool closing;
+  long stalls;                 // Times begin() found the ring full.
+  pthread_t thread;
+};
+
+#endif